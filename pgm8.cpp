@@ -1,10 +1,52 @@
+#include <array>
+#include <algorithm>
 #include <string>
 #include <sstream>
 #include <cassert>
 #include <cstring>
+#include <memory>
+#include <charconv>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <bit>
+#include <new>
+#include <filesystem>
+#include <optional>
+#include <cstdio>
 
 #include "pgm8.hpp"
 
+#if PGM8_POSIX
+# include <cerrno>
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/uio.h>
+# include <unistd.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+# define PGM8_IO_URING 1
+# include <linux/io_uring.h>
+# include <sys/syscall.h>
+#else
+# define PGM8_IO_URING 0
+#endif
+
+// Opt-in, as it needs linking against zlib.
+#ifndef PGM8_ZLIB
+# define PGM8_ZLIB 0
+#endif
+#if PGM8_ZLIB
+# include <climits>
+# include <zlib.h>
+#endif
+
 uint16_t pgm8::image_properties::get_width() const noexcept { return m_width; }
 uint16_t pgm8::image_properties::get_height() const noexcept { return m_height; }
 uint8_t pgm8::image_properties::get_maxval() const noexcept { return m_maxval; }
@@ -23,9 +65,25 @@ void ensure_greater_than_zero(Ty v, char const *const name)
 static
 void ensure_legal_format(pgm8::format const v)
 {
-  if (v != pgm8::format::PLAIN && v != pgm8::format::RAW)
-    throw std::runtime_error("illegal format, must be PLAIN (2) or RAW (5)");
+  if (v != pgm8::format::PLAIN && v != pgm8::format::RAW && v != pgm8::format::COMPRESSED)
+    throw std::runtime_error("illegal format, must be PLAIN (2), RAW (5) or COMPRESSED (8)");
+}
+
+static
+bool is_whitespace(unsigned char const ch) noexcept
+{
+  return ch == ' ' || (ch >= '\t' && ch <= '\r');
+}
+
+#if PGM8_POSIX
+static
+std::runtime_error make_errno_error(char const *const what)
+{
+  std::stringstream err{};
+  err << what << ": " << std::strerror(errno);
+  return std::runtime_error(err.str());
 }
+#endif
 
 void pgm8::image_properties::set_width(uint16_t const v)
 {
@@ -65,6 +123,182 @@ void pgm8::image_properties::validate() const
   if (!m_fmt_set) throw std::runtime_error("format not set");
 }
 
+// Default comment handler for the parsers below.
+struct ignore_comments
+{
+  void operator()(char const *, char const *) const noexcept {}
+};
+
+// Parses the image properties at the start of [begin, end), up to and
+// including the single whitespace char following maxval. As the netpbm spec
+// allows, fields may be separated by any whitespace and by comments (from # to
+// the end of the line); each comment is handed to `on_comment(begin, end)`
+// without its #.
+template <typename OnComment = ignore_comments>
+pgm8::image_properties parse_properties(
+  char const *const begin,
+  char const *const end,
+  size_t &num_consumed,
+  OnComment const &on_comment = {})
+{
+  using namespace pgm8;
+
+  char const *p = begin;
+
+  if (end - p < 2 || p[0] != 'P' || (p[1] != '2' && p[1] != '5' && p[1] != '8'))
+    throw std::runtime_error("invalid magic number, corrupt or non-PGM file");
+  // the format values are the magic digits
+  auto const fmt = static_cast<format>(p[1] - '0');
+  p += 2;
+
+  // p is at a #, steps past the end of the line
+  auto const parse_comment = [&p, end, &on_comment]()
+  {
+    auto const newline = static_cast<char const *>(
+      std::memchr(p, '\n', static_cast<size_t>(end - p)));
+    if (newline == nullptr)
+      throw std::runtime_error("unexpected end of header");
+    on_comment(p + 1, newline);
+    p = newline + 1;
+  };
+
+  auto const parse_field = [&](char const *const name, unsigned const max)
+  {
+    for (;;) {
+      if (p < end && is_whitespace(static_cast<unsigned char>(*p)))
+        ++p;
+      else if (p < end && *p == '#')
+        parse_comment();
+      else
+        break;
+    }
+
+    unsigned value = 0;
+    auto const [ptr, ec] = std::from_chars(p, end, value);
+    if (ec != std::errc{} || value > max) {
+      std::stringstream err{};
+      err << "invalid " << name << " in header";
+      throw std::runtime_error(err.str());
+    }
+    p = ptr;
+    return value;
+  };
+
+  unsigned const width = parse_field("width", UINT16_MAX);
+  unsigned const height = parse_field("height", UINT16_MAX);
+  unsigned const maxval = parse_field("maxval", UINT8_MAX);
+
+  // eat the \n after maxval, which may end a comment
+  if (p == end)
+    throw std::runtime_error("unexpected end of header");
+  if (*p == '#')
+    parse_comment();
+  else if (is_whitespace(static_cast<unsigned char>(*p)))
+    ++p;
+  else
+    throw std::runtime_error("missing whitespace after maxval");
+
+  image_properties props;
+  props.set_width(static_cast<uint16_t>(width));
+  props.set_height(static_cast<uint16_t>(height));
+  props.set_maxval(static_cast<uint8_t>(maxval));
+  props.set_format(fmt);
+
+  num_consumed = static_cast<size_t>(p - begin);
+  return props;
+}
+
+// Steps over consecutive comment lines at the start of [begin, end), handing
+// each to `on_comment(begin, end)` without its #. Returns the number of chars consumed.
+template <typename OnComment = ignore_comments>
+size_t parse_comments(
+  char const *const begin,
+  char const *const end,
+  OnComment const &on_comment = {})
+{
+  char const *p = begin;
+
+  while (p < end && *p == '#')
+  {
+    auto const newline = static_cast<char const *>(
+      std::memchr(p, '\n', static_cast<size_t>(end - p)));
+    char const *const line_end = (newline == nullptr) ? end : newline;
+
+    on_comment(p + 1, line_end);
+
+    p = (newline == nullptr) ? end : newline + 1;
+  }
+
+  return static_cast<size_t>(p - begin);
+}
+
+// Copies the header at the position of `src` into `buffer` char by char,
+// stopping exactly where parse_properties (then parse_comments, if
+// `with_comments`) stops. Nothing past the header is read, so the stream
+// doesn't have to be seekable. Returns the number of chars copied.
+static
+size_t copy_header(
+  std::streambuf &src,
+  std::array<char, pgm8::header::capacity> &buffer,
+  bool const with_comments)
+{
+  using traits = std::streambuf::traits_type;
+
+  size_t num_copied = 0;
+  auto const take = [&]()
+  {
+    if (num_copied == buffer.size())
+      throw std::runtime_error("header too large");
+    buffer[num_copied++] = traits::to_char_type(src.sbumpc());
+  };
+  // takes up to and including the next \n
+  auto const take_line = [&]()
+  {
+    for (int ch = src.sgetc(); ch != traits::eof(); ch = src.sgetc()) {
+      take();
+      if (ch == '\n')
+        break;
+    }
+  };
+  auto const is_digit = [](int const ch) { return ch >= '0' && ch <= '9'; };
+
+  for (int i = 0; i < 2 && src.sgetc() != traits::eof(); ++i)
+    take();
+  // anything else is rejected by parse_properties without reading further
+  if (num_copied < 2 || buffer[0] != 'P')
+    return num_copied;
+
+  for (int field = 0; field < 3; ++field)
+  {
+    for (int ch = src.sgetc(); ch != traits::eof(); ch = src.sgetc()) {
+      if (is_whitespace(static_cast<unsigned char>(ch)))
+        take();
+      else if (ch == '#')
+        take_line();
+      else
+        break;
+    }
+
+    if (!is_digit(src.sgetc()))
+      return num_copied;
+    while (is_digit(src.sgetc()))
+      take();
+  }
+
+  // the single whitespace char or comment after maxval
+  int const ch = src.sgetc();
+  if (ch == '#')
+    take_line();
+  else if (ch != traits::eof() && is_whitespace(static_cast<unsigned char>(ch)))
+    take();
+
+  if (with_comments)
+    while (src.sgetc() == '#')
+      take_line();
+
+  return num_copied;
+}
+
 pgm8::image_properties pgm8::read_properties(std::ifstream &file)
 {
   if (!file.is_open())
@@ -72,155 +306,4564 @@ pgm8::image_properties pgm8::read_properties(std::ifstream &file)
   if (!file.good())
     throw std::runtime_error("file not in good state");
 
-  format const fmt = [&file]()
+  // leaves the stream right after maxval, where comments start
+  std::array<char, header::capacity> buffer;
+  size_t const num_read = copy_header(*file.rdbuf(), buffer, false);
+
+  size_t num_consumed = 0;
+  return parse_properties(buffer.data(), buffer.data() + num_read, num_consumed);
+}
+
+size_t pgm8::internal::plain_decoder::feed(
+  char const *const begin,
+  char const *const end)
+{
+  char const *p = begin;
+
+  while (p < end)
+  {
+    auto const ch = static_cast<unsigned char>(*p);
+    unsigned const digit = static_cast<unsigned>(ch) - '0';
+
+    if (digit < 10)
+    {
+      value = (value * 10) + digit;
+      if (value > UINT8_MAX) {
+        std::stringstream err{};
+        err << "pixel " << (first_index + num_decoded) << " out of range (> " << UINT8_MAX << ')';
+        throw std::runtime_error(err.str());
+      }
+      ++num_digits;
+    }
+    else if (is_whitespace(ch))
+    {
+      if (num_digits > 0) {
+        out[num_decoded++] = static_cast<uint8_t>(value);
+        value = 0;
+        num_digits = 0;
+        if (num_decoded == num_pixels)
+          return static_cast<size_t>(p - begin);
+      }
+    }
+    else
+    {
+      std::stringstream err{};
+      err << "pixel " << (first_index + num_decoded) << " malformed, unexpected character (code " << static_cast<unsigned>(ch) << ')';
+      throw std::runtime_error(err.str());
+    }
+
+    ++p;
+  }
+
+  return static_cast<size_t>(p - begin);
+}
+
+void pgm8::internal::plain_decoder::finish()
+{
+  if (num_digits > 0 && num_decoded < num_pixels) {
+    out[num_decoded++] = static_cast<uint8_t>(value);
+    value = 0;
+    num_digits = 0;
+  }
+
+  if (num_decoded < num_pixels) {
+    std::stringstream err{};
+    err << "unexpected end of pixel data, read " << num_decoded << " of " << num_pixels << " pixels";
+    throw std::runtime_error(err.str());
+  }
+}
+
+// COMPRESSED control bytes: 0..127 start a literal run of (byte + 1) bytes,
+// 128..255 a run of (byte - 126) copies of the byte that follows.
+static constexpr size_t s_max_literal_run = 128;
+static constexpr size_t s_max_repeat_run = 129;
+static constexpr uint8_t s_repeat_run_base = 126;
+
+// Adds the row above to the residuals in `row`, then makes the result the new
+// row above.
+static
+void undo_row_prediction(
+  uint8_t *const row,
+  uint8_t *const above,
+  size_t const width) noexcept
+{
+  // fixed-size groups through a local so the compiler vectorizes at -O2
+  // without having to prove `row` and `above` don't overlap
+  static constexpr size_t lanes = 32;
+
+  size_t x = 0;
+  for (; x + lanes <= width; x += lanes) {
+    uint8_t sums[lanes];
+    for (size_t j = 0; j < lanes; ++j)
+      sums[j] = static_cast<uint8_t>(row[x + j] + above[x + j]);
+    std::memcpy(row + x, sums, lanes);
+    std::memcpy(above + x, sums, lanes);
+  }
+  for (; x < width; ++x) {
+    row[x] = static_cast<uint8_t>(row[x] + above[x]);
+    above[x] = row[x];
+  }
+}
+
+size_t pgm8::internal::compressed_decoder::feed(
+  char const *const begin,
+  char const *const end)
+{
+  auto const *p = reinterpret_cast<uint8_t const *>(begin);
+  auto const *const bytes_end = reinterpret_cast<uint8_t const *>(end);
+
+  while (p < bytes_end && !done())
   {
-    auto const string_starts_with = [](
-      std::string const &subject,
-      char const *const sequence)
+    uint8_t *const row = out + (num_rows_decoded * width);
+
+    if (run_len == 0)
     {
-      size_t const seq_len = std::strlen(sequence);
+      // runs that are wholly in the input, the common case. Locals so the
+      // compiler doesn't reload members after every store.
+      size_t const row_len = width;
+      size_t pos = row_pos;
+      while (pos < row_len && p < bytes_end)
+      {
+        uint8_t const control = *p;
+        bool const is_repeat = control > (s_max_literal_run - 1);
+        size_t const len = is_repeat ? size_t{control} - s_repeat_run_base : size_t{control} + 1;
+        size_t const encoded_len = is_repeat ? 2 : len + 1;
 
-      if (subject.length() < seq_len)
-        return false;
+        if (static_cast<size_t>(bytes_end - p) < encoded_len || len > row_len - pos)
+          break;
+        if (is_repeat)
+          std::memset(row + pos, p[1], len);
+        else
+          std::memcpy(row + pos, p + 1, len);
+        p += encoded_len;
+        pos += len;
+      }
+      row_pos = pos;
 
-      for (size_t i = 0; i < seq_len; ++i)
-        if (subject[i] != sequence[i])
-          return false;
+      // a run split by the end of the input, or a corrupt one
+      if (row_pos < width)
+      {
+        if (p == bytes_end)
+          break;
 
-      return true;
-    };
+        uint8_t const control = *p++;
+        run_is_repeat = control > (s_max_literal_run - 1);
+        run_len = run_is_repeat ? size_t{control} - s_repeat_run_base : size_t{control} + 1;
 
-    std::string magic_num{};
-    std::getline(file, magic_num);
-    if (string_starts_with(magic_num, "P5"))
-      return format::RAW;
-    else if (string_starts_with(magic_num, "P2"))
-      return format::PLAIN;
+        if (run_len > width - row_pos) {
+          std::stringstream err{};
+          err << "compressed row " << (first_row + num_rows_decoded) << " corrupt, run past end of row";
+          throw std::runtime_error(err.str());
+        }
+        continue;
+      }
+    }
+    else if (run_is_repeat)
+    {
+      std::memset(row + row_pos, *p++, run_len);
+      row_pos += run_len;
+      run_len = 0;
+    }
     else
-      throw std::runtime_error("invalid magic number, corrupt or non-PGM file");
-  }();
+    {
+      size_t const count = std::min(run_len, static_cast<size_t>(bytes_end - p));
+      std::memcpy(row + row_pos, p, count);
+      p += count;
+      row_pos += count;
+      run_len -= count;
+    }
+
+    if (row_pos == width)
+    {
+      undo_row_prediction(row, prev_row, width);
+      row_pos = 0;
+      ++num_rows_decoded;
+    }
+  }
 
-  uint16_t width, height;
-  file >> width >> height;
+  return static_cast<size_t>(reinterpret_cast<char const *>(p) - begin);
+}
 
-  uint8_t maxval;
+void pgm8::internal::compressed_decoder::finish() const
+{
+  if (!done()) {
+    std::stringstream err{};
+    err << "unexpected end of pixel data, read " << num_rows_decoded << " of " << num_rows << " rows";
+    throw std::runtime_error(err.str());
+  }
+}
+
+// Fewest bytes the rest of a COMPRESSED raster can span, with `decoder` partway
+// through its rows and `num_rows_after` rows following them: what's left of
+// the run in progress, then repeat runs of the longest length.
+static
+size_t min_compressed_raster_len(
+  pgm8::internal::compressed_decoder const &decoder,
+  size_t const num_rows_after) noexcept
+{
+  auto const min_len = [](size_t const num_pixels)
   {
-    int maxval_;
-    file >> maxval_;
-    maxval = static_cast<uint8_t>(maxval_);
+    return 2 * ((num_pixels + s_max_repeat_run - 1) / s_max_repeat_run);
+  };
+
+  if (decoder.done())
+    return num_rows_after * min_len(decoder.width);
+
+  size_t const run_left = (decoder.run_len == 0) ? 0 : (decoder.run_is_repeat ? 1 : decoder.run_len);
+  size_t const num_rows_left = decoder.num_rows - decoder.num_rows_decoded - 1 + num_rows_after;
+  return run_left
+    + min_len(decoder.width - decoder.row_pos - decoder.run_len)
+    + (num_rows_left * min_len(decoder.width));
+}
+
+// Longest encoding of a COMPRESSED row, all literal runs.
+static
+size_t max_compressed_row_len(size_t const width) noexcept
+{
+  return width + ((width + s_max_literal_run - 1) / s_max_literal_run);
+}
+
+// Size of the state kept while encoding COMPRESSED rows of `width`: the row
+// above, the residuals of the current row and its encoding.
+static
+size_t compressed_state_size(size_t const width) noexcept
+{
+  return (width * 2) + max_compressed_row_len(width);
+}
+
+// Encodes one COMPRESSED row, returning its encoding which is valid until the
+// next call. `state` holds compressed_state_size(width) bytes, zeroed before
+// the first row.
+static
+std::span<uint8_t const> encode_compressed_row(
+  uint8_t const *const row,
+  size_t const width,
+  uint8_t *const state) noexcept
+{
+  uint8_t *const prev_row = state;
+  uint8_t *const residuals = state + width;
+  uint8_t *const encoded = state + (width * 2);
+
+  static constexpr size_t lanes = 32; // as in undo_row_prediction
+
+  size_t x = 0;
+  for (; x + lanes <= width; x += lanes) {
+    uint8_t diffs[lanes];
+    for (size_t j = 0; j < lanes; ++j)
+      diffs[j] = static_cast<uint8_t>(row[x + j] - prev_row[x + j]);
+    std::memcpy(residuals + x, diffs, lanes);
   }
+  for (; x < width; ++x)
+    residuals[x] = static_cast<uint8_t>(row[x] - prev_row[x]);
+  std::memcpy(prev_row, row, width);
 
-  // eat the \n after maxval
+  // length of the run of equal residuals starting at i
+  auto const run_at = [residuals, width](size_t const i) noexcept
   {
-    char whitespace[1];
-    file.read(whitespace, sizeof(whitespace));
+    size_t const limit = std::min(width - i, s_max_repeat_run);
+    size_t len = 1;
+    while (len < limit && residuals[i + len] == residuals[i])
+      ++len;
+    return len;
+  };
+
+  uint8_t *out = encoded;
+  for (size_t i = 0; i < width; )
+  {
+    size_t const run = run_at(i);
+    if (run >= 2)
+    {
+      *out++ = static_cast<uint8_t>(run + s_repeat_run_base);
+      *out++ = residuals[i];
+      i += run;
+      continue;
+    }
+
+    // a literal run, ended by a repeat worth breaking it for
+    size_t len = 1;
+    while (len < s_max_literal_run && i + len < width && run_at(i + len) < 3)
+      ++len;
+    *out++ = static_cast<uint8_t>(len - 1);
+    std::memcpy(out, residuals + i, len);
+    out += len;
+    i += len;
   }
 
-  image_properties props;
-  props.set_width(width);
-  props.set_height(height);
-  props.set_maxval(maxval);
-  props.set_format(fmt);
+  return { encoded, static_cast<size_t>(out - encoded) };
+}
 
-  return props;
+// Size of the blocks PLAIN pixel data is read in.
+static constexpr size_t s_plain_block_size = pgm8::row_reader::scratch_size;
+
+// Longest text emitted for a PLAIN sample, "255 ".
+static constexpr size_t s_plain_max_sample_len = 4;
+
+// Fewest chars the rest of a PLAIN raster can span with `num_pixels` pixels
+// left to decode: a digit each and whitespace between them. If the decoder is
+// `in_token`, that token only needs the whitespace ending it.
+static
+size_t min_plain_raster_len(size_t const num_pixels, bool const in_token) noexcept
+{
+  if (num_pixels == 0)
+    return 0;
+  return (2 * num_pixels) - (in_token ? 2 : 1);
 }
 
-void pgm8::read_pixels(
+// Feeds `decoder` from `file` until it's done, staging text in `block` (of
+// `block_size` chars, [block_pos, block_len) still unconsumed). `num_after` is
+// the number of raster pixels following the decoder's. Never reads past the
+// raster, so the stream needn't be seekable to leave it right after.
+static
+void feed_plain_raster(
   std::ifstream &file,
-  image_properties const props,
-  uint8_t *const buffer)
+  pgm8::internal::plain_decoder &decoder,
+  size_t const num_after,
+  char *const block,
+  size_t const block_size,
+  size_t &block_pos,
+  size_t &block_len)
 {
-  size_t const num_pixels = static_cast<size_t>(props.get_width()) * props.get_height();
+  using traits = std::ifstream::traits_type;
+  std::streambuf &src = *file.rdbuf();
 
-  if (props.get_format() == pgm8::format::RAW)
-  {
-    file.read(reinterpret_cast<char *>(buffer), num_pixels);
-  }
-  else // format::PLAIN
+  while (!decoder.done())
   {
-    char pixel[4] {};
-    for (size_t i = 0; i < num_pixels; ++i) {
-      file >> pixel;
-      buffer[i] = static_cast<uint8_t>(std::stoul(pixel));
+    if (block_pos == block_len)
+    {
+      size_t const num_left = decoder.num_pixels - decoder.num_decoded + num_after;
+      size_t const len = std::min(block_size, min_plain_raster_len(num_left, decoder.num_digits > 0));
+
+      // the last token may be complete, only the next char tells
+      if (len == 0)
+      {
+        int const ch = src.sgetc();
+        if (ch == traits::eof()) {
+          file.setstate(std::ios::eofbit);
+          decoder.finish();
+          break;
+        }
+        char const c = traits::to_char_type(ch);
+        if (decoder.feed(&c, &c + 1) == 1)
+          src.sbumpc();
+        continue;
+      }
+
+      block_pos = 0;
+      block_len = static_cast<size_t>(src.sgetn(block, static_cast<std::streamsize>(len)));
+
+      if (block_len == 0) {
+        file.setstate(std::ios::eofbit);
+        decoder.finish();
+        break;
+      }
     }
+
+    block_pos += decoder.feed(block + block_pos, block + block_len);
   }
 }
 
-void pgm8::write(
-  std::ofstream &file,
-  image_properties const props,
-  std::vector<std::string> const &comments,
-  uint8_t const *pixels)
+// Maps samples from [0, from] to [0, to] as (v * to + from / 2) / from, with
+// samples above `from` saturating. For 8-bit samples a 16.16 fixed-point
+// multiply gives exactly that quotient without overflowing 32 bits.
+class sample_scaler
 {
-  props.validate();
+public:
+  sample_scaler(uint8_t const from, uint8_t const to) noexcept
+    : m_from(from)
+    , m_multiplier(((uint32_t{to} << 16) + from - 1) / from)
+    , m_rounding(((uint32_t{from} / 2) << 16) / from)
+  {}
 
-  uint16_t const width = props.get_width(), height = props.get_height();
-  uint8_t const maxval = props.get_maxval();
-  format const fmt = props.get_format();
+  void apply(uint8_t *const samples, size_t const count) const noexcept
+  {
+    // fixed-size groups so the compiler vectorizes the inner loop at -O2
+    static constexpr size_t lanes = 32;
 
-  ensure_greater_than_zero(props.get_width(), "width");
-  ensure_greater_than_zero(props.get_height(), "height");
-  ensure_greater_than_zero(props.get_maxval(), "maxval");
-  ensure_legal_format(fmt);
+    size_t i = 0;
+    for (; i + lanes <= count; i += lanes)
+      for (size_t j = 0; j < lanes; ++j)
+        samples[i + j] = scale(samples[i + j]);
+    for (; i < count; ++i)
+      samples[i] = scale(samples[i]);
+  }
 
-  // header
+private:
+  [[nodiscard]] uint8_t scale(uint8_t const v) const noexcept
   {
-    int const magic_num = (fmt == format::RAW) ? 5 : /* format::PLAIN */ 2;
-    file
-      << 'P' << magic_num << '\n'
-      << std::to_string(width) << ' ' << std::to_string(height) << '\n'
-      << std::to_string(maxval) << '\n';
+    uint32_t const clamped = std::min<uint32_t>(v, m_from);
+    return static_cast<uint8_t>(((clamped * m_multiplier) + m_rounding) >> 16);
+  }
+
+  uint32_t m_from;
+  uint32_t m_multiplier;
+  uint32_t m_rounding;
+};
+
+// Largest of `count` samples, 0 if there are none.
+static
+uint8_t max_sample(uint8_t const *const samples, size_t const count) noexcept
+{
+  // reduced in fixed-size groups so the compiler vectorizes the inner loop at -O2
+  static constexpr size_t lanes = 32;
+  uint8_t result = 0;
+
+  size_t i = 0;
+  for (; i + lanes <= count; i += lanes) {
+    uint8_t group = 0;
+    for (size_t j = 0; j < lanes; ++j)
+      group = samples[i + j] > group ? samples[i + j] : group;
+    result = std::max(result, group);
   }
+  for (; i < count; ++i)
+    result = std::max(result, samples[i]);
 
-  // comments
-  for (auto const &cmt : comments)
-    file << '#' << cmt << '\n';
+  return result;
+}
+
+// Throws if any of `count` samples is above `maxval`. `first_index` is the
+// index of samples[0] within the image, used in the error message.
+static
+void ensure_samples_within(
+  uint8_t const *const samples,
+  size_t const count,
+  uint8_t const maxval,
+  size_t const first_index)
+{
+  if (max_sample(samples, count) <= maxval)
+    return;
 
-  // pixels
-  if (fmt == format::RAW)
+  auto const bad = std::find_if(samples, samples + count, [maxval](uint8_t const v) { return v > maxval; });
+  std::stringstream err{};
+  err << "pixel " << (first_index + static_cast<size_t>(bad - samples))
+      << " out of range (> " << static_cast<unsigned>(maxval) << ')';
+  throw std::runtime_error(err.str());
+}
+
+// Work done on each block of decoded samples while it's still in cache, as
+// asked for by read_options: validation against maxval, then rescaling.
+class decode_pass
+{
+public:
+  decode_pass(pgm8::image_properties const props, pgm8::read_options const &options) noexcept
+    : m_maxval(props.get_maxval())
+    , m_validate(options.validate)
   {
-    size_t const num_pixels = static_cast<size_t>(width) * height;
-    file.write(reinterpret_cast<char const *>(pixels), num_pixels);
+    if (options.rescale && m_maxval != UINT8_MAX)
+      m_scaler.emplace(m_maxval, UINT8_MAX);
   }
-  else // format::PLAIN
+
+  [[nodiscard]] bool empty() const noexcept
   {
-    for (size_t r = 0; r < height; ++r)
-    {
-      for (size_t c = 0; c < width; ++c)
-        file << std::to_string(pixels[(r * width) + c]) << ' ';
-      file << '\n';
-    }
+    return !m_validate && !m_scaler;
+  }
+
+  void apply(uint8_t *const samples, size_t const count, size_t const first_index) const
+  {
+    if (m_validate)
+      ensure_samples_within(samples, count, m_maxval, first_index);
+    if (m_scaler)
+      m_scaler->apply(samples, count);
   }
+
+private:
+  std::optional<sample_scaler> m_scaler{};
+  uint8_t m_maxval;
+  bool m_validate;
+};
+
+pgm8::image_properties pgm8::header::get_properties() const noexcept { return m_props; }
+size_t pgm8::header::get_raster_offset() const noexcept { return m_raster_offset; }
+size_t pgm8::header::num_comments() const noexcept { return m_num_comments; }
+
+std::string_view pgm8::header::get_comment(size_t const idx) const noexcept
+{
+  assert(idx < m_num_comments);
+  comment_record const &rec = m_comments[idx];
+  return { m_buffer.data() + rec.offset, rec.length };
 }
 
-std::vector<std::string> pgm8::read_comments(std::ifstream &file)
+void pgm8::header::parse(size_t const num_valid, bool const more_follows)
 {
-  std::vector<std::string> comments{};
-  std::string line{};
+  char const *const begin = m_buffer.data();
+  char const *const end = begin + num_valid;
 
-  int ch = file.peek();
-  while (ch == '#') {
-    int const comment_char = file.get(); // eat #
-    assert(comment_char == '#');
-    std::getline(file, line, '\n');
-    comments.emplace_back(std::move(line));
-    ch = file.peek();
+  m_num_comments = 0;
+  auto const record = [this, begin](char const *const b, char const *const e)
+  {
+    m_comments[m_num_comments++] = {
+      static_cast<uint16_t>(b - begin),
+      static_cast<uint16_t>(e - b),
+    };
+  };
+
+  try
+  {
+    m_props = parse_properties(begin, end, m_raster_offset, record);
+    m_raster_offset += parse_comments(begin + m_raster_offset, end, record);
+  }
+  catch (std::runtime_error const &)
+  {
+    if (more_follows)
+      throw std::runtime_error("header too large");
+    throw;
   }
 
-  return comments;
+  // the last comment line may continue past the buffer
+  if (more_follows && m_raster_offset == num_valid)
+    throw std::runtime_error("header too large");
 }
 
-size_t pgm8::skip_comments(std::ifstream &file)
+pgm8::header pgm8::read_header(std::ifstream &file)
 {
-  std::string line{};
-  size_t count = 0;
+  if (!file.is_open())
+    throw std::runtime_error("file not open");
+  if (!file.good())
+    throw std::runtime_error("file not in good state");
 
-  int ch = file.peek();
-  while (ch == '#') {
-    std::getline(file, line, '\n');
-    ++count;
-    ch = file.peek();
+  // leaves the stream at the start of the raster
+  header hdr;
+  size_t const num_read = copy_header(*file.rdbuf(), hdr.m_buffer, true);
+  hdr.parse(num_read, false);
+  return hdr;
+}
+
+pgm8::header pgm8::read_header(std::span<uint8_t const> const buffer)
+{
+  header hdr;
+  size_t const num_valid = std::min(buffer.size(), header::capacity);
+  std::memcpy(hdr.m_buffer.data(), buffer.data(), num_valid);
+  hdr.parse(num_valid, buffer.size() > header::capacity);
+  return hdr;
+}
+
+void pgm8::read_pixels(
+  std::ifstream &file,
+  image_properties const props,
+  uint8_t *const buffer)
+{
+  size_t const num_pixels = static_cast<size_t>(props.get_width()) * props.get_height();
+
+  if (props.get_format() == pgm8::format::RAW)
+  {
+    file.read(reinterpret_cast<char *>(buffer), static_cast<std::streamsize>(num_pixels));
   }
+  else // format::PLAIN or format::COMPRESSED
+  {
+    // reused so repeated decodes don't allocate
+    thread_local std::unique_ptr<char []> scratch(new char[row_reader::scratch_size]);
 
-  return count;
+    row_reader reader(file, props, scratch.get());
+    reader.read_rows(buffer, props.get_height());
+  }
 }
+
+static
+unsigned resolve_num_threads(unsigned const requested) noexcept
+{
+  if (requested != 0)
+    return requested;
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Calls `fn(i)` for every i in [0, num_tasks) using up to `num_threads` threads,
+// the calling thread included. If tasks throw, the exception of the task with
+// the lowest index is rethrown once all tasks have finished.
+template <typename Fn>
+void parallel_for(size_t const num_tasks, unsigned const num_threads, Fn const &fn)
+{
+  std::vector<std::exception_ptr> errors(num_tasks);
+  std::atomic<size_t> next_task = 0;
+
+  auto const work = [&]()
+  {
+    for (size_t i; (i = next_task.fetch_add(1)) < num_tasks; )
+    {
+      try { fn(i); }
+      catch (...) { errors[i] = std::current_exception(); }
+    }
+  };
+
+  size_t const num_helpers = std::min<size_t>(num_threads, num_tasks) - (num_tasks > 0 ? 1 : 0);
+  std::vector<std::thread> helpers{};
+  helpers.reserve(num_helpers);
+  for (size_t i = 0; i < num_helpers; ++i)
+    helpers.emplace_back(work);
+  work();
+  for (auto &helper : helpers)
+    helper.join();
+
+  for (auto const &err : errors)
+    if (err)
+      std::rethrow_exception(err);
+}
+
+// Parses the properties and comment lines in the first `num_valid` bytes of a
+// file. Returns false if they may continue past those bytes.
+static
+bool parse_probe(
+  char const *const begin,
+  size_t const num_valid,
+  bool const more_follows,
+  pgm8::probe_result &result)
+{
+  char const *const end = begin + num_valid;
+  try
+  {
+    result.props = parse_properties(begin, end, result.raster_offset);
+    result.raster_offset += parse_comments(begin + result.raster_offset, end);
+  }
+  catch (std::runtime_error const &)
+  {
+    if (more_follows)
+      return false;
+    throw;
+  }
+  return !(more_follows && result.raster_offset == num_valid);
+}
+
+// Enough for the header of a typical file.
+static constexpr size_t s_probe_size = 512;
+
+pgm8::probe_result pgm8::probe(std::string const &path)
+{
+  probe_result result{};
+  std::array<char, header::capacity> buffer;
+
+#if PGM8_POSIX
+  int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    throw make_errno_error("failed to open file");
+
+  try
+  {
+    for (size_t const size : { s_probe_size, header::capacity })
+    {
+      ssize_t const num_read = ::pread(fd, buffer.data(), size, 0);
+      if (num_read == -1)
+        throw make_errno_error("failed to read file");
+
+      auto const num_valid = static_cast<size_t>(num_read);
+      bool const more_follows = num_valid == size;
+      if (parse_probe(buffer.data(), num_valid, more_follows, result))
+        break;
+      if (size == header::capacity)
+        throw std::runtime_error("header too large");
+    }
+  }
+  catch (...)
+  {
+    ::close(fd);
+    throw;
+  }
+  ::close(fd);
+#else
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open())
+    throw std::runtime_error("failed to open file");
+
+  auto const num_valid = static_cast<size_t>(
+    file.rdbuf()->sgetn(buffer.data(), static_cast<std::streamsize>(buffer.size())));
+  if (!parse_probe(buffer.data(), num_valid, num_valid == buffer.size(), result))
+    throw std::runtime_error("header too large");
+#endif
+
+  return result;
+}
+
+std::vector<pgm8::probe_result> pgm8::probe_many(
+  std::vector<std::string> const &paths,
+  unsigned const num_threads)
+{
+  std::vector<probe_result> results(paths.size());
+
+  parallel_for(paths.size(), resolve_num_threads(num_threads), [&](size_t const i)
+  {
+    try
+    {
+      results[i] = probe(paths[i]);
+    }
+    catch (...)
+    {
+      results[i].error = std::current_exception();
+    }
+  });
+
+  return results;
+}
+
+static
+size_t count_plain_tokens(char const *const begin, char const *const end) noexcept
+{
+  size_t count = 0;
+  bool in_token = false;
+  for (char const *p = begin; p < end; ++p) {
+    bool const ws = is_whitespace(static_cast<unsigned char>(*p));
+    count += (!ws && !in_token);
+    in_token = !ws;
+  }
+  return count;
+}
+
+struct plain_parallel_result
+{
+  size_t num_consumed;
+  size_t num_decoded;
+};
+
+// Decodes up to `num_pixels` PLAIN pixels from [begin, end), which must not end
+// in the middle of a token, splitting the work across threads. If given,
+// `pass` is applied to each chunk's pixels right after they're decoded.
+static
+plain_parallel_result decode_plain_parallel(
+  char const *const begin,
+  char const *const end,
+  uint8_t *const out,
+  size_t const num_pixels,
+  size_t const first_index,
+  unsigned const num_threads,
+  size_t const chunk_size,
+  decode_pass const *const pass)
+{
+  // split at whitespace so no token straddles two chunks
+  std::vector<char const *> bounds{ begin };
+  for (char const *p = begin + std::min(chunk_size, static_cast<size_t>(end - begin)); p < end; )
+  {
+    while (p < end && !is_whitespace(static_cast<unsigned char>(*p)))
+      ++p;
+    if (p < end)
+      bounds.push_back(p);
+    p += std::min(chunk_size, static_cast<size_t>(end - p));
+  }
+  bounds.push_back(end);
+
+  size_t const num_chunks = bounds.size() - 1;
+
+  // each chunk's output offset is the number of tokens before it
+  std::vector<size_t> offsets(num_chunks + 1, 0);
+  parallel_for(num_chunks, num_threads, [&](size_t const i)
+  {
+    offsets[i + 1] = count_plain_tokens(bounds[i], bounds[i + 1]);
+  });
+  for (size_t i = 0; i < num_chunks; ++i)
+    offsets[i + 1] += offsets[i];
+
+  std::vector<size_t> consumed(num_chunks, 0);
+  parallel_for(num_chunks, num_threads, [&](size_t const i)
+  {
+    if (offsets[i] >= num_pixels || offsets[i + 1] == offsets[i])
+      return;
+
+    size_t const count = std::min(offsets[i + 1], num_pixels) - offsets[i];
+    pgm8::internal::plain_decoder decoder{ out + offsets[i], count };
+    decoder.first_index = first_index + offsets[i];
+
+    consumed[i] = decoder.feed(bounds[i], bounds[i + 1]);
+    if (!decoder.done())
+      decoder.finish();
+    if (pass != nullptr)
+      pass->apply(decoder.out, count, decoder.first_index);
+  });
+
+  size_t const num_decoded = std::min(offsets[num_chunks], num_pixels);
+  if (num_decoded < num_pixels)
+    return { static_cast<size_t>(end - begin), num_decoded };
+
+  // the last chunk holding a wanted pixel determines how far we got
+  size_t last = num_chunks - 1;
+  while (offsets[last] >= num_pixels)
+    --last;
+  return { static_cast<size_t>(bounds[last] - begin) + consumed[last], num_decoded };
+}
+
+// Like the plain read_pixels, but applies `pass` to each block of pixels as
+// soon as it's decoded, while it's still in cache.
+static
+void read_pixels_in_blocks(
+  std::ifstream &file,
+  pgm8::image_properties const props,
+  uint8_t *const buffer,
+  decode_pass const &pass)
+{
+  size_t const num_pixels = props.num_pixels();
+
+  if (props.get_format() == pgm8::format::RAW)
+  {
+    for (size_t pos = 0; pos < num_pixels && file; pos += s_plain_block_size) {
+      size_t const count = std::min(s_plain_block_size, num_pixels - pos);
+      file.read(reinterpret_cast<char *>(buffer + pos), static_cast<std::streamsize>(count));
+      pass.apply(buffer + pos, static_cast<size_t>(file.gcount()), pos);
+    }
+  }
+  else // format::PLAIN or format::COMPRESSED
+  {
+    thread_local std::unique_ptr<char []> scratch(new char[pgm8::row_reader::scratch_size]);
+
+    size_t const width = props.get_width();
+    size_t const rows_per_block = std::max<size_t>(1, s_plain_block_size / width);
+    pgm8::row_reader reader(file, props, scratch.get());
+
+    for (size_t pos = 0; reader.rows_remaining() > 0; ) {
+      size_t const count = reader.read_rows(buffer + pos, rows_per_block) * width;
+      pass.apply(buffer + pos, count, pos);
+      pos += count;
+    }
+  }
+}
+
+void pgm8::read_pixels(
+  std::ifstream &file,
+  image_properties const props,
+  uint8_t *const buffer,
+  read_options const &options)
+{
+  unsigned const num_threads = resolve_num_threads(options.num_threads);
+  decode_pass const pass(props, options);
+
+  if (props.get_format() != format::PLAIN || num_threads == 1) {
+    if (pass.empty())
+      read_pixels(file, props, buffer);
+    else
+      read_pixels_in_blocks(file, props, buffer, pass);
+    return;
+  }
+
+  ensure_greater_than_zero(options.chunk_size, "chunk_size");
+  // room for at least one token per chunk
+  size_t const chunk_size = std::max(options.chunk_size, s_plain_max_sample_len);
+
+  size_t const num_pixels = props.num_pixels();
+  // no bigger than the raster as this library writes it, longer ones take more batches
+  size_t const batch_size = std::min(
+    num_threads * chunk_size,
+    (num_pixels * s_plain_max_sample_len) + props.get_height());
+  std::unique_ptr<char []> batch(new char[batch_size]);
+  size_t batch_len = 0;
+  size_t num_decoded = 0;
+  std::streambuf &src = *file.rdbuf();
+
+  for (;;)
+  {
+    // never past the raster, so nothing has to be given back
+    size_t const num_left = min_plain_raster_len(num_pixels - num_decoded, false);
+    size_t const num_requested = std::min(
+      batch_size - batch_len,
+      num_left > batch_len ? num_left - batch_len : 0);
+    // too little left to share out, the rest is decoded serially
+    if (num_requested < chunk_size)
+      break;
+
+    auto const num_read = static_cast<size_t>(
+      src.sgetn(batch.get() + batch_len, static_cast<std::streamsize>(num_requested)));
+    batch_len += num_read;
+    bool const at_eof = num_read < num_requested;
+
+    // hold back a trailing partial token for the next batch
+    size_t text_len = batch_len;
+    if (!at_eof)
+    {
+      while (text_len > 0 && !is_whitespace(static_cast<unsigned char>(batch[text_len - 1])))
+        --text_len;
+      // a single token filling the batch
+      if (text_len == 0)
+        break;
+    }
+
+    auto const res = decode_plain_parallel(
+      batch.get(), batch.get() + text_len,
+      buffer + num_decoded, num_pixels - num_decoded, num_decoded,
+      num_threads, chunk_size, pass.empty() ? nullptr : &pass);
+    num_decoded += res.num_decoded;
+
+    if (num_decoded == num_pixels)
+      return;
+
+    if (at_eof) {
+      file.setstate(std::ios::eofbit);
+      std::stringstream err{};
+      err << "unexpected end of pixel data, read " << num_decoded << " of " << num_pixels << " pixels";
+      throw std::runtime_error(err.str());
+    }
+
+    std::memmove(batch.get(), batch.get() + text_len, batch_len - text_len);
+    batch_len -= text_len;
+  }
+
+  internal::plain_decoder decoder{ buffer + num_decoded, num_pixels - num_decoded };
+  decoder.first_index = num_decoded;
+  size_t batch_pos = 0;
+  feed_plain_raster(file, decoder, 0, batch.get(), batch_size, batch_pos, batch_len);
+  if (!pass.empty())
+    pass.apply(decoder.out, decoder.num_pixels, decoder.first_index);
+}
+
+// Largest run of unwanted bytes read_region reads through rather than seeking
+// over, and the most it reads in one request.
+static constexpr size_t s_region_max_gap = 4 * 1024;
+static constexpr size_t s_region_block_size = 256 * 1024;
+
+void pgm8::read_region(
+  std::ifstream &file,
+  image_properties const props,
+  uint16_t const x,
+  uint16_t const y,
+  uint16_t const w,
+  uint16_t const h,
+  uint8_t *const dst,
+  size_t const dst_stride)
+{
+  props.validate();
+  if (props.get_format() != format::RAW)
+    throw std::runtime_error("regions can only be read from RAW images");
+
+  ensure_greater_than_zero(w, "region width");
+  ensure_greater_than_zero(h, "region height");
+
+  size_t const width = props.get_width();
+  if (size_t{x} + w > width || size_t{y} + h > props.get_height())
+    throw std::runtime_error("region out of bounds");
+  if (dst_stride < w)
+    throw std::runtime_error("dst_stride must be >= region width");
+
+  std::streampos const raster_start = file.tellg();
+  if (raster_start == std::streampos(-1))
+    throw std::runtime_error("file not in good state");
+
+  auto const read_at = [&file, raster_start](size_t const offset, uint8_t *const out, size_t const len)
+  {
+    file.seekg(raster_start + static_cast<std::streamoff>(offset));
+    file.read(reinterpret_cast<char *>(out), static_cast<std::streamsize>(len));
+    if (static_cast<size_t>(file.gcount()) != len)
+      throw std::runtime_error("unexpected end of pixel data");
+  };
+
+  size_t const first_offset = (size_t{y} * width) + x;
+
+  if (w == width && dst_stride == width)
+  {
+    // whole rows, contiguous both in the file and in dst
+    read_at(first_offset, dst, size_t{h} * width);
+  }
+  else if (width - w <= s_region_max_gap)
+  {
+    // gaps between rows are small, read several rows per request and drop the gaps
+    size_t const rows_per_read = std::clamp<size_t>(s_region_block_size / width, 1, h);
+    size_t const max_span = ((rows_per_read - 1) * width) + w;
+    std::unique_ptr<uint8_t []> span(new uint8_t[max_span]);
+
+    for (size_t r = 0; r < h; r += rows_per_read)
+    {
+      size_t const num_rows = std::min(rows_per_read, h - r);
+      read_at(first_offset + (r * width), span.get(), ((num_rows - 1) * width) + w);
+      for (size_t i = 0; i < num_rows; ++i)
+        std::memcpy(dst + ((r + i) * dst_stride), span.get() + (i * width), w);
+    }
+  }
+  else
+  {
+    for (size_t r = 0; r < h; ++r)
+      read_at(first_offset + (r * width), dst + (r * dst_stride), w);
+  }
+
+  file.seekg(raster_start + static_cast<std::streamoff>(props.num_pixels()));
+}
+
+pgm8::row_reader::row_reader(std::ifstream &file, image_properties const props)
+  : row_reader(file, props, nullptr)
+{}
+
+pgm8::row_reader::row_reader(
+  std::ifstream &file,
+  image_properties const props,
+  char *const scratch)
+  : m_file(file)
+  , m_props(props)
+  , m_block(scratch)
+{
+  m_props.validate();
+  if (m_props.get_format() != format::RAW && m_block == nullptr) {
+    m_owned_block.reset(new char[scratch_size]);
+    m_block = m_owned_block.get();
+  }
+  if (m_props.get_format() == format::COMPRESSED)
+    m_prev_row.reset(new uint8_t[m_props.get_width()]());
+}
+
+size_t pgm8::row_reader::rows_remaining() const noexcept
+{
+  return static_cast<size_t>(m_props.get_height()) - m_num_rows_read;
+}
+
+size_t pgm8::row_reader::read_rows(uint8_t *const buffer, size_t const max_rows)
+{
+  size_t const num_rows = std::min(max_rows, rows_remaining());
+  if (num_rows == 0)
+    return 0;
+
+  size_t const num_pixels = num_rows * m_props.get_width();
+
+  if (m_props.get_format() == format::RAW)
+  {
+    m_file.read(reinterpret_cast<char *>(buffer), static_cast<std::streamsize>(num_pixels));
+    if (static_cast<size_t>(m_file.gcount()) != num_pixels)
+      throw std::runtime_error("unexpected end of pixel data");
+  }
+  else if (m_props.get_format() == format::COMPRESSED)
+  {
+    internal::compressed_decoder decoder{ buffer, m_props.get_width(), num_rows, m_prev_row.get() };
+    decoder.first_row = m_num_rows_read;
+    size_t const num_rows_after = rows_remaining() - num_rows;
+    std::streambuf &src = *m_file.rdbuf();
+
+    while (!decoder.done())
+    {
+      if (m_block_pos == m_block_len)
+      {
+        // never past the raster, so the stream needn't be seekable to leave it right after
+        size_t const len = std::min(s_plain_block_size, min_compressed_raster_len(decoder, num_rows_after));
+        m_block_pos = 0;
+        m_block_len = static_cast<size_t>(src.sgetn(m_block, static_cast<std::streamsize>(len)));
+
+        if (m_block_len == 0) {
+          m_file.setstate(std::ios::eofbit);
+          decoder.finish();
+          break;
+        }
+      }
+
+      m_block_pos += decoder.feed(m_block + m_block_pos, m_block + m_block_len);
+    }
+  }
+  else // format::PLAIN
+  {
+    internal::plain_decoder decoder{ buffer, num_pixels };
+    decoder.first_index = m_num_rows_read * m_props.get_width();
+    size_t const num_after = (rows_remaining() - num_rows) * m_props.get_width();
+    feed_plain_raster(m_file, decoder, num_after, m_block, s_plain_block_size, m_block_pos, m_block_len);
+  }
+
+  m_num_rows_read += num_rows;
+
+  return num_rows;
+}
+
+pgm8::image_properties pgm8::downscaled_properties(image_properties props, uint16_t const factor)
+{
+  props.validate();
+  if (factor == 0 || factor > max_downscale_factor) {
+    std::stringstream err{};
+    err << "factor must be 1-" << max_downscale_factor;
+    throw std::runtime_error(err.str());
+  }
+
+  props.set_width(static_cast<uint16_t>((props.get_width() + factor - 1) / factor));
+  props.set_height(static_cast<uint16_t>((props.get_height() + factor - 1) / factor));
+  return props;
+}
+
+// Divides by a fixed count with rounding to nearest, exact for dividends of up
+// to 255 * count, count at most 2^16.
+class box_divider
+{
+public:
+  explicit box_divider(uint32_t const count) noexcept
+    : m_multiplier(((uint64_t{1} << s_shift) + count - 1) / count)
+    , m_half(count / 2)
+  {}
+
+  [[nodiscard]] uint8_t divide(uint32_t const sum) const noexcept
+  {
+    return static_cast<uint8_t>(((sum + m_half) * m_multiplier) >> s_shift);
+  }
+
+private:
+  // exact while dividend * count < 2^s_shift, and (255 * 2^16 + 2^15) * 2^16 < 2^40
+  static constexpr unsigned s_shift = 40;
+
+  uint64_t m_multiplier;
+  uint64_t m_half;
+};
+
+// Sums each run of `factor` samples in `row` into `box_sums`, for `num_boxes`
+// boxes. Factor is a template parameter for the common factors, 0 means
+// `factor` is used instead.
+template <size_t Factor>
+void sum_row_boxes(
+  uint8_t const *const row,
+  size_t const factor,
+  size_t const num_boxes,
+  uint16_t *const box_sums) noexcept
+{
+  // The common factors read a box as one word and add its bytes within the
+  // word, so every load is contiguous and the compiler vectorizes at -O2.
+  using word = std::conditional_t<Factor == 2, uint16_t, std::conditional_t<Factor == 4, uint32_t, uint64_t>>;
+  static constexpr size_t lanes = 32;
+
+  size_t b = 0;
+  if constexpr (Factor == 2 || Factor == 4 || Factor == 8)
+  {
+    static_assert(sizeof(word) == Factor);
+
+    for (; b + lanes <= num_boxes; b += lanes)
+    {
+      word words[lanes];
+      std::memcpy(words, row + (b * Factor), sizeof words);
+
+      uint16_t sums[lanes];
+      for (size_t j = 0; j < lanes; ++j)
+      {
+        word w = words[j];
+        // pairs of bytes into 16-bit fields, then pairs of those into 32-bit fields
+        w = static_cast<word>((w & static_cast<word>(0x00ff00ff00ff00ffull)) + ((w >> 8) & static_cast<word>(0x00ff00ff00ff00ffull)));
+        if constexpr (Factor >= 4)
+          w = static_cast<word>((w & static_cast<word>(0x0000ffff0000ffffull)) + ((w >> 16) & static_cast<word>(0x0000ffff0000ffffull)));
+        if constexpr (Factor == 8)
+          w = (w & 0xffffffffull) + (w >> 32);
+        sums[j] = static_cast<uint16_t>(w);
+      }
+      std::memcpy(box_sums + b, sums, sizeof sums);
+    }
+  }
+
+  size_t const box_width = (Factor != 0) ? Factor : factor;
+  for (; b < num_boxes; ++b)
+  {
+    uint32_t sum = 0;
+    for (size_t k = 0; k < box_width; ++k)
+      sum += row[(b * box_width) + k];
+    box_sums[b] = static_cast<uint16_t>(sum);
+  }
+}
+
+// Adds a row's box sums to the running sums of the boxes.
+static
+void add_box_sums(
+  uint32_t *const sums,
+  uint16_t const *const row_sums,
+  size_t const count) noexcept
+{
+  // as in undo_row_prediction
+  static constexpr size_t lanes = 32;
+
+  size_t b = 0;
+  for (; b + lanes <= count; b += lanes) {
+    uint32_t group[lanes];
+    for (size_t j = 0; j < lanes; ++j)
+      group[j] = sums[b + j] + row_sums[b + j];
+    std::memcpy(sums + b, group, sizeof group);
+  }
+  for (; b < count; ++b)
+    sums[b] += row_sums[b];
+}
+
+void pgm8::read_downscaled(
+  std::ifstream &file,
+  image_properties const props,
+  uint16_t const factor,
+  uint8_t *const buffer)
+{
+  image_properties const out_props = downscaled_properties(props, factor);
+
+  size_t const width = props.get_width(), height = props.get_height();
+  size_t const out_width = out_props.get_width();
+  // boxes in the last column may be narrower
+  size_t const num_full_boxes = width / factor;
+  size_t const last_box_width = width - ((out_width - 1) * factor);
+
+  // memory scales with the output and one block of input rows, not the input
+  size_t const rows_per_read = std::clamp<size_t>(s_plain_block_size / width, 1, factor);
+  std::unique_ptr<uint8_t []> rows(new uint8_t[rows_per_read * width]);
+  // a row's box sums fit 16 bits, as 255 * max_downscale_factor < 2^16
+  std::unique_ptr<uint16_t []> row_box_sums(new uint16_t[out_width]);
+  std::unique_ptr<uint32_t []> box_sums(new uint32_t[out_width]);
+
+  thread_local std::unique_ptr<char []> scratch(new char[row_reader::scratch_size]);
+  row_reader reader(file, props, scratch.get());
+
+  for (size_t out_y = 0; out_y < out_props.get_height(); ++out_y)
+  {
+    // boxes in the last row may be shorter
+    size_t const box_height = std::min<size_t>(factor, height - (out_y * factor));
+    std::fill_n(box_sums.get(), out_width, uint32_t{0});
+
+    for (size_t r = 0; r < box_height; )
+    {
+      size_t const num_rows = reader.read_rows(rows.get(), std::min(rows_per_read, box_height - r));
+      for (size_t i = 0; i < num_rows; ++i)
+      {
+        uint8_t const *const row = rows.get() + (i * width);
+        switch (factor)
+        {
+          case 2: sum_row_boxes<2>(row, factor, num_full_boxes, row_box_sums.get()); break;
+          case 4: sum_row_boxes<4>(row, factor, num_full_boxes, row_box_sums.get()); break;
+          case 8: sum_row_boxes<8>(row, factor, num_full_boxes, row_box_sums.get()); break;
+          default: sum_row_boxes<0>(row, factor, num_full_boxes, row_box_sums.get()); break;
+        }
+        if (num_full_boxes < out_width)
+          sum_row_boxes<0>(row + (num_full_boxes * factor), last_box_width, 1, row_box_sums.get() + num_full_boxes);
+
+        add_box_sums(box_sums.get(), row_box_sums.get(), out_width);
+      }
+      r += num_rows;
+    }
+
+    uint8_t *const out_row = buffer + (out_y * out_width);
+    box_divider const full(static_cast<uint32_t>(factor * box_height));
+    for (size_t b = 0; b < num_full_boxes; ++b)
+      out_row[b] = full.divide(box_sums[b]);
+    if (num_full_boxes < out_width) {
+      box_divider const last(static_cast<uint32_t>(last_box_width * box_height));
+      out_row[num_full_boxes] = last.divide(box_sums[num_full_boxes]);
+    }
+  }
+}
+
+struct plain_sample_text
+{
+  char chars[s_plain_max_sample_len];
+  uint8_t len;
+};
+
+// Decimal text (plus separating space) of every possible sample value.
+static constexpr auto s_plain_sample_table = []()
+{
+  std::array<plain_sample_text, UINT8_MAX + 1> table{};
+  for (unsigned v = 0; v <= UINT8_MAX; ++v)
+  {
+    plain_sample_text &entry = table[v];
+    if (v >= 100) entry.chars[entry.len++] = static_cast<char>('0' + (v / 100));
+    if (v >= 10) entry.chars[entry.len++] = static_cast<char>('0' + ((v / 10) % 10));
+    entry.chars[entry.len++] = static_cast<char>('0' + (v % 10));
+    entry.chars[entry.len++] = ' ';
+  }
+  return table;
+}();
+
+// Writes `count` samples as PLAIN text starting at `out`, which must have room
+// for `count * s_plain_max_sample_len` chars. Returns one past the last char written.
+static
+char *format_plain_samples(
+  uint8_t const *const samples,
+  size_t const count,
+  char *out) noexcept
+{
+  for (size_t i = 0; i < count; ++i) {
+    plain_sample_text const &entry = s_plain_sample_table[samples[i]];
+    std::memcpy(out, entry.chars, s_plain_max_sample_len);
+    out += entry.len;
+  }
+  return out;
+}
+
+static
+void validate_for_write(pgm8::image_properties const props)
+{
+  props.validate();
+
+  ensure_greater_than_zero(props.get_width(), "width");
+  ensure_greater_than_zero(props.get_height(), "height");
+  ensure_greater_than_zero(props.get_maxval(), "maxval");
+  ensure_legal_format(props.get_format());
+}
+
+static
+std::string format_header(
+  pgm8::image_properties const props,
+  std::vector<std::string> const &comments)
+{
+  // the format values are the magic digits
+  auto const magic_num = static_cast<int>(props.get_format());
+
+  std::string header{};
+  header += 'P';
+  header += std::to_string(magic_num);
+  header += '\n';
+  header += std::to_string(props.get_width());
+  header += ' ';
+  header += std::to_string(props.get_height());
+  header += '\n';
+  header += std::to_string(props.get_maxval());
+  header += '\n';
+
+  for (auto const &cmt : comments) {
+    header += '#';
+    header += cmt;
+    header += '\n';
+  }
+
+  return header;
+}
+
+// Formats `num_rows` rows of PLAIN pixels into `block` (s_plain_block_size chars,
+// of which `block_len` are already used), handing full blocks to
+// `sink(char const *data, size_t len)`. Whatever doesn't fill a block is left
+// in `block` for the caller to flush.
+template <typename Sink>
+void encode_plain_rows(
+  Sink &sink,
+  uint8_t const *const pixels,
+  size_t const width,
+  size_t const num_rows,
+  char *const block,
+  size_t &block_len)
+{
+  char *const block_end = block + s_plain_block_size;
+  char *out = block + block_len;
+
+  for (size_t r = 0; r < num_rows; ++r)
+  {
+    uint8_t const *row = pixels + (r * width);
+    size_t remaining = width;
+
+    while (remaining > 0)
+    {
+      // reserve 1 char for the row's trailing newline
+      size_t const capacity = static_cast<size_t>(block_end - out - 1) / s_plain_max_sample_len;
+      if (capacity == 0) {
+        sink(block, static_cast<size_t>(out - block));
+        out = block;
+        continue;
+      }
+      size_t const count = std::min(remaining, capacity);
+      out = format_plain_samples(row, count, out);
+      row += count;
+      remaining -= count;
+    }
+
+    *out++ = '\n';
+  }
+
+  block_len = static_cast<size_t>(out - block);
+}
+
+// Encodes `num_rows` COMPRESSED rows into `block` like encode_plain_rows.
+// `state` carries the row above between calls, see encode_compressed_row.
+template <typename Sink>
+void encode_compressed_rows(
+  Sink &sink,
+  uint8_t const *const pixels,
+  size_t const width,
+  size_t const num_rows,
+  uint8_t *const state,
+  char *const block,
+  size_t &block_len)
+{
+  for (size_t r = 0; r < num_rows; ++r)
+  {
+    auto const encoded = encode_compressed_row(pixels + (r * width), width, state);
+
+    if (s_plain_block_size - block_len < encoded.size()) {
+      sink(block, block_len);
+      block_len = 0;
+    }
+    if (encoded.size() > s_plain_block_size) {
+      // only for very wide rows
+      sink(reinterpret_cast<char const *>(encoded.data()), encoded.size());
+      continue;
+    }
+    std::memcpy(block + block_len, encoded.data(), encoded.size());
+    block_len += encoded.size();
+  }
+}
+
+// Formats PLAIN rows in blocks of `rows_per_block` on several threads, each
+// block into its own buffer, then hands the buffers to `sink` in row order.
+// If given, `scaler` is applied to a copy of each row before it's formatted,
+// and each block is checked against `validate_maxval` first.
+template <typename Sink>
+void encode_plain_rows_parallel(
+  Sink &sink,
+  uint8_t const *const pixels,
+  size_t const width,
+  size_t const height,
+  unsigned const num_threads,
+  size_t const rows_per_block,
+  sample_scaler const *const scaler,
+  std::optional<uint8_t> const validate_maxval)
+{
+  size_t const num_blocks = (height + rows_per_block - 1) / rows_per_block;
+  size_t const max_row_len = (width * s_plain_max_sample_len) + 1;
+  size_t const blocks_per_wave = std::min<size_t>(num_threads, num_blocks);
+
+  std::vector<std::unique_ptr<char []>> buffers(blocks_per_wave);
+  for (auto &buf : buffers)
+    buf.reset(new char[rows_per_block * max_row_len]);
+  std::vector<size_t> lengths(blocks_per_wave, 0);
+
+  for (size_t first_block = 0; first_block < num_blocks; first_block += blocks_per_wave)
+  {
+    size_t const num_wave_blocks = std::min(blocks_per_wave, num_blocks - first_block);
+
+    parallel_for(num_wave_blocks, num_threads, [&](size_t const i)
+    {
+      size_t const first_row = (first_block + i) * rows_per_block;
+      size_t const num_rows = std::min(rows_per_block, height - first_row);
+      char *out = buffers[i].get();
+
+      if (validate_maxval) {
+        ensure_samples_within(
+          pixels + (first_row * width), num_rows * width, *validate_maxval, first_row * width);
+      }
+
+      std::unique_ptr<uint8_t []> scaled_row(scaler != nullptr ? new uint8_t[width] : nullptr);
+
+      for (size_t r = first_row; r < first_row + num_rows; ++r) {
+        uint8_t const *row = pixels + (r * width);
+        if (scaler != nullptr) {
+          std::memcpy(scaled_row.get(), row, width);
+          scaler->apply(scaled_row.get(), width);
+          row = scaled_row.get();
+        }
+        out = format_plain_samples(row, width, out);
+        *out++ = '\n';
+      }
+      lengths[i] = static_cast<size_t>(out - buffers[i].get());
+    });
+
+    for (size_t i = 0; i < num_wave_blocks; ++i)
+      sink(buffers[i].get(), lengths[i]);
+  }
+}
+
+// Whether `file`, positioned at its start, holds gzip data. Leaves it at the start.
+static
+bool is_gzip(std::ifstream &file)
+{
+  unsigned char magic[2]{};
+  file.read(reinterpret_cast<char *>(magic), sizeof magic);
+  bool const gzip = file.gcount() == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+  file.clear();
+  file.seekg(0);
+  return gzip;
+}
+
+static constexpr char const *s_gzip_unsupported = "gzip data, but pgm8 was built without PGM8_ZLIB";
+
+static
+void ensure_legal_gzip_level(int const level)
+{
+  if (level < 0 || level > 9)
+    throw std::runtime_error("gzip_level must be 0-9");
+#if !PGM8_ZLIB
+  if (level != 0)
+    throw std::runtime_error(s_gzip_unsupported);
+#endif
+}
+
+#if PGM8_ZLIB
+
+// Size of the chunks gzip data is inflated from and deflated into.
+static constexpr size_t s_gzip_chunk_size = 64 * 1024;
+
+[[noreturn]] static
+void throw_zlib_error(char const *const what, z_stream const &stream, int const code)
+{
+  std::stringstream err{};
+  err << what << ", " << (stream.msg != nullptr ? stream.msg : zError(code));
+  throw std::runtime_error(err.str());
+}
+
+// Inflates gzip data read from a file in fixed-size chunks. Concatenated
+// gzip members are read as one stream, as gunzip does.
+class gzip_source
+{
+public:
+  explicit gzip_source(std::ifstream &file)
+    : m_file(file)
+    , m_in(new char[s_gzip_chunk_size])
+    , m_out(new char[s_gzip_chunk_size])
+  {
+    // gzip wrapper only, no raw deflate or zlib
+    int const res = inflateInit2(&m_stream, 16 + MAX_WBITS);
+    if (res != Z_OK)
+      throw_zlib_error("failed to start inflating", m_stream, res);
+  }
+
+  gzip_source(gzip_source const &) = delete;
+  gzip_source &operator=(gzip_source const &) = delete;
+
+  ~gzip_source()
+  {
+    inflateEnd(&m_stream);
+  }
+
+  // Inflated data not yet consumed, at least `min_len` chars of it unless the
+  // stream ends first. Empty once the stream is exhausted.
+  std::span<char const> peek(size_t const min_len = 1)
+  {
+    assert(min_len <= s_gzip_chunk_size);
+
+    if (m_out_len - m_out_pos < min_len && !m_at_end)
+    {
+      std::memmove(m_out.get(), m_out.get() + m_out_pos, m_out_len - m_out_pos);
+      m_out_len -= m_out_pos;
+      m_out_pos = 0;
+
+      while (m_out_len < min_len && !m_at_end)
+        inflate_more();
+    }
+
+    return { m_out.get() + m_out_pos, m_out_len - m_out_pos };
+  }
+
+  void consume(size_t const len) noexcept
+  {
+    m_out_pos += len;
+  }
+
+  // Inflates and drops whatever is left, which makes zlib check the CRC of
+  // the final member.
+  void skip_rest()
+  {
+    for (std::span<char const> rest; !(rest = peek()).empty(); )
+      consume(rest.size());
+  }
+
+private:
+  void inflate_more()
+  {
+    if (m_stream.avail_in == 0)
+    {
+      m_file.read(m_in.get(), static_cast<std::streamsize>(s_gzip_chunk_size));
+      auto const num_read = static_cast<size_t>(m_file.gcount());
+      if (num_read == 0)
+        throw std::runtime_error("unexpected end of gzip data");
+      m_stream.next_in = reinterpret_cast<Bytef *>(m_in.get());
+      m_stream.avail_in = static_cast<uInt>(num_read);
+    }
+
+    m_stream.next_out = reinterpret_cast<Bytef *>(m_out.get() + m_out_len);
+    m_stream.avail_out = static_cast<uInt>(s_gzip_chunk_size - m_out_len);
+    int const res = inflate(&m_stream, Z_NO_FLUSH);
+    m_out_len = s_gzip_chunk_size - m_stream.avail_out;
+
+    if (res == Z_STREAM_END)
+    {
+      // another member may follow
+      if (m_stream.avail_in == 0 && m_file.peek() == std::ifstream::traits_type::eof())
+        m_at_end = true;
+      else
+        inflateReset(&m_stream);
+    }
+    else if (res != Z_OK)
+    {
+      throw_zlib_error("corrupt gzip data", m_stream, res);
+    }
+  }
+
+  std::ifstream &m_file;
+  z_stream m_stream{};
+  std::unique_ptr<char []> m_in, m_out;
+  size_t m_out_pos = 0, m_out_len = 0;
+  bool m_at_end = false;
+};
+
+// Parses the header of a gzipped image, leaving `src` at the raster.
+static
+pgm8::header read_gzip_header(gzip_source &src)
+{
+  auto const chars = src.peek(pgm8::header::capacity);
+  pgm8::header hdr = pgm8::read_header(
+    { reinterpret_cast<uint8_t const *>(chars.data()), chars.size() });
+  src.consume(hdr.get_raster_offset());
+  return hdr;
+}
+
+static
+std::vector<std::string> copy_comments(pgm8::header const &hdr)
+{
+  std::vector<std::string> comments{};
+  comments.reserve(hdr.num_comments());
+  for (size_t i = 0; i < hdr.num_comments(); ++i)
+    comments.emplace_back(hdr.get_comment(i));
+  return comments;
+}
+
+template <typename Decoder>
+void feed_from(gzip_source &src, Decoder &decoder)
+{
+  while (!decoder.done())
+  {
+    auto const chars = src.peek();
+    if (chars.empty()) {
+      decoder.finish();
+      break;
+    }
+    src.consume(decoder.feed(chars.data(), chars.data() + chars.size()));
+  }
+}
+
+// Decodes the raster of a gzipped image a row at a time, each into `row_at(r)`.
+template <typename RowAt>
+void read_gzip_pixels(gzip_source &src, pgm8::image_properties const props, RowAt const &row_at)
+{
+  size_t const width = props.get_width();
+  std::unique_ptr<uint8_t []> prev_row(
+    props.get_format() == pgm8::format::COMPRESSED ? new uint8_t[width]() : nullptr);
+
+  for (size_t r = 0; r < props.get_height(); ++r)
+  {
+    uint8_t *const row = row_at(r);
+
+    if (props.get_format() == pgm8::format::RAW)
+    {
+      for (size_t pos = 0; pos < width; )
+      {
+        auto const chars = src.peek();
+        if (chars.empty())
+          throw std::runtime_error("unexpected end of pixel data");
+        size_t const count = std::min(width - pos, chars.size());
+        std::memcpy(row + pos, chars.data(), count);
+        src.consume(count);
+        pos += count;
+      }
+    }
+    else if (props.get_format() == pgm8::format::COMPRESSED)
+    {
+      pgm8::internal::compressed_decoder decoder{ row, width, 1, prev_row.get() };
+      decoder.first_row = r;
+      feed_from(src, decoder);
+    }
+    else // format::PLAIN
+    {
+      pgm8::internal::plain_decoder decoder{ row, width };
+      decoder.first_index = r * width;
+      feed_from(src, decoder);
+    }
+  }
+}
+
+// Deflates everything handed to it into gzip, passing it on to `sink` in
+// fixed-size chunks. finish() must be called after the last of the input.
+template <typename Sink>
+class gzip_sink
+{
+public:
+  gzip_sink(Sink &sink, int const level)
+    : m_sink(sink)
+    , m_out(new char[s_gzip_chunk_size])
+  {
+    int const res = deflateInit2(&m_stream, level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    if (res != Z_OK)
+      throw_zlib_error("failed to start deflating", m_stream, res);
+  }
+
+  gzip_sink(gzip_sink const &) = delete;
+  gzip_sink &operator=(gzip_sink const &) = delete;
+
+  ~gzip_sink()
+  {
+    deflateEnd(&m_stream);
+  }
+
+  void operator()(char const *const data, size_t const len)
+  {
+    // RAW rasters are passed whole, but never exceed UINT_MAX bytes
+    static_assert(size_t{UINT16_MAX} * UINT16_MAX <= UINT_MAX);
+    run(data, len, Z_NO_FLUSH);
+  }
+
+  void finish()
+  {
+    run(nullptr, 0, Z_FINISH);
+  }
+
+private:
+  void run(char const *const data, size_t const len, int const flush)
+  {
+    m_stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    m_stream.avail_in = static_cast<uInt>(len);
+
+    do
+    {
+      m_stream.next_out = reinterpret_cast<Bytef *>(m_out.get());
+      m_stream.avail_out = static_cast<uInt>(s_gzip_chunk_size);
+      int const res = deflate(&m_stream, flush);
+      if (res == Z_STREAM_ERROR)
+        throw_zlib_error("failed to deflate", m_stream, res);
+
+      size_t const num_produced = s_gzip_chunk_size - m_stream.avail_out;
+      if (num_produced > 0)
+        m_sink(m_out.get(), num_produced);
+    }
+    while (m_stream.avail_out == 0);
+  }
+
+  Sink &m_sink;
+  z_stream m_stream{};
+  std::unique_ptr<char []> m_out;
+};
+
+#endif // PGM8_ZLIB
+
+// Computes maxval if `options` asks for it, then checks `props`. Done before
+// anything is emitted, as the header needs maxval.
+static
+void prepare_for_write(
+  pgm8::image_properties &props,
+  uint8_t const *const pixels,
+  pgm8::write_options const &options)
+{
+  if (options.compute_maxval)
+    props.set_maxval(std::max<uint8_t>(1, max_sample(pixels, props.num_pixels())));
+  validate_for_write(props);
+}
+
+// Encodes the pixels of an image which went through prepare_for_write, handing
+// the output to `sink(char const *data, size_t len)` in order. PLAIN pixels are
+// formatted into blocks of s_plain_block_size. If options.validate is set, each
+// block of rows is checked against maxval just before it's encoded, so output
+// stops short of the first bad block.
+template <typename Sink>
+void encode_raster(
+  Sink &sink,
+  pgm8::image_properties const props,
+  uint8_t const *const pixels,
+  pgm8::write_options const &options)
+{
+  size_t const width = props.get_width(), height = props.get_height();
+
+  std::optional<sample_scaler> scaler{};
+  if (options.rescale && props.get_maxval() != UINT8_MAX)
+    scaler.emplace(UINT8_MAX, props.get_maxval());
+
+  // computed or rescaled samples can't exceed maxval
+  std::optional<uint8_t> validate_maxval{};
+  if (options.validate && !options.compute_maxval && !options.rescale)
+    validate_maxval = props.get_maxval();
+  auto const check_rows = [&](size_t const first_row, size_t const num_rows)
+  {
+    if (validate_maxval)
+      ensure_samples_within(pixels + (first_row * width), num_rows * width, *validate_maxval, first_row * width);
+  };
+  bool const in_stages = scaler || validate_maxval;
+
+  // rescaled pixels are staged in blocks of whole rows
+  size_t const rows_per_stage = std::max<size_t>(1, s_plain_block_size / width);
+  std::unique_ptr<uint8_t []> stage(scaler ? new uint8_t[rows_per_stage * width] : nullptr);
+  auto const stage_rows = [&](size_t const first_row, size_t const num_rows)
+  {
+    check_rows(first_row, num_rows);
+    if (!scaler)
+      return pixels + (first_row * width);
+    std::memcpy(stage.get(), pixels + (first_row * width), num_rows * width);
+    scaler->apply(stage.get(), num_rows * width);
+    return static_cast<uint8_t const *>(stage.get());
+  };
+
+  if (props.get_format() == pgm8::format::RAW)
+  {
+    if (!in_stages) {
+      sink(reinterpret_cast<char const *>(pixels), width * height);
+    } else {
+      for (size_t r = 0; r < height; r += rows_per_stage) {
+        size_t const num_rows = std::min(rows_per_stage, height - r);
+        sink(reinterpret_cast<char const *>(stage_rows(r, num_rows)), num_rows * width);
+      }
+    }
+  }
+  else if (props.get_format() == pgm8::format::COMPRESSED)
+  {
+    // rows depend on the ones above, so this is always sequential
+    std::unique_ptr<uint8_t []> state(new uint8_t[compressed_state_size(width)]());
+    std::unique_ptr<char []> block(new char[s_plain_block_size]);
+    size_t block_len = 0;
+    for (size_t r = 0; r < height; r += rows_per_stage) {
+      size_t const num_rows = std::min(rows_per_stage, height - r);
+      encode_compressed_rows(sink, stage_rows(r, num_rows), width, num_rows, state.get(), block.get(), block_len);
+    }
+    sink(block.get(), block_len);
+  }
+  else // format::PLAIN
+  {
+    unsigned const num_threads = resolve_num_threads(options.num_threads);
+    ensure_greater_than_zero(options.rows_per_block, "rows_per_block");
+
+    if (num_threads > 1 && height > options.rows_per_block)
+    {
+      encode_plain_rows_parallel(
+        sink, pixels, width, height, num_threads, options.rows_per_block,
+        scaler ? &*scaler : nullptr, validate_maxval);
+    }
+    else
+    {
+      std::unique_ptr<char []> block(new char[s_plain_block_size]);
+      size_t block_len = 0;
+      if (!in_stages) {
+        encode_plain_rows(sink, pixels, width, height, block.get(), block_len);
+      } else {
+        for (size_t r = 0; r < height; r += rows_per_stage) {
+          size_t const num_rows = std::min(rows_per_stage, height - r);
+          encode_plain_rows(sink, stage_rows(r, num_rows), width, num_rows, block.get(), block_len);
+        }
+      }
+      sink(block.get(), block_len);
+    }
+  }
+}
+
+// Encodes a whole image like encode_raster, header and comments included.
+// Ignores options.gzip_level, see encode_image.
+template <typename Sink>
+void encode_pgm(
+  Sink &sink,
+  pgm8::image_properties props,
+  std::vector<std::string> const &comments,
+  uint8_t const *const pixels,
+  pgm8::write_options const &options)
+{
+  prepare_for_write(props, pixels, options);
+
+  std::string const header = format_header(props, comments);
+  sink(header.data(), header.size());
+
+  encode_raster(sink, props, pixels, options);
+}
+
+// encode_pgm, gzipped at options.gzip_level if that's set.
+template <typename Sink>
+void encode_image(
+  Sink &sink,
+  pgm8::image_properties const props,
+  std::vector<std::string> const &comments,
+  uint8_t const *const pixels,
+  pgm8::write_options const &options)
+{
+  ensure_legal_gzip_level(options.gzip_level);
+
+#if PGM8_ZLIB
+  if (options.gzip_level != 0) {
+    gzip_sink<Sink> gzip(sink, options.gzip_level);
+    encode_pgm(gzip, props, comments, pixels, options);
+    gzip.finish();
+    return;
+  }
+#endif
+
+  encode_pgm(sink, props, comments, pixels, options);
+}
+
+void pgm8::write(
+  std::ofstream &file,
+  image_properties const props,
+  std::vector<std::string> const &comments,
+  uint8_t const *pixels)
+{
+  write(file, props, comments, pixels, write_options{});
+}
+
+void pgm8::write(
+  std::ofstream &file,
+  image_properties const props,
+  std::vector<std::string> const &comments,
+  uint8_t const *const pixels,
+  write_options const &options)
+{
+  auto sink = [&file](char const *const data, size_t const len)
+  {
+    file.write(data, static_cast<std::streamsize>(len));
+  };
+  encode_image(sink, props, comments, pixels, options);
+}
+
+// Like pgm8::max_encoded_size, but also valid when maxval is yet to be computed.
+static
+size_t encoded_size_bound(
+  pgm8::image_properties props,
+  std::vector<std::string> const &comments,
+  pgm8::write_options const &options)
+{
+  if (options.compute_maxval)
+    props.set_maxval(UINT8_MAX); // the widest maxval
+  size_t const size = pgm8::max_encoded_size(props, comments);
+  if (options.gzip_level == 0)
+    return size;
+  // deflateBound's worst case, plus the gzip header and trailer
+  return size + (size >> 12) + (size >> 14) + (size >> 25) + 7 + 18;
+}
+
+size_t pgm8::write(
+  std::span<uint8_t> const buffer,
+  image_properties const props,
+  std::vector<std::string> const &comments,
+  uint8_t const *const pixels)
+{
+  size_t num_produced = 0;
+  auto sink = [&buffer, &num_produced](char const *const data, size_t const len)
+  {
+    if (buffer.size() - num_produced < len)
+      throw std::runtime_error("buffer too small for encoded image");
+    std::memcpy(buffer.data() + num_produced, data, len);
+    num_produced += len;
+  };
+  encode_image(sink, props, comments, pixels, write_options{});
+  return num_produced;
+}
+
+size_t pgm8::write(
+  std::vector<uint8_t> &buffer,
+  image_properties const props,
+  std::vector<std::string> const &comments,
+  uint8_t const *const pixels)
+{
+  return write(buffer, props, comments, pixels, write_options{});
+}
+
+size_t pgm8::write(
+  std::vector<uint8_t> &buffer,
+  image_properties const props,
+  std::vector<std::string> const &comments,
+  uint8_t const *const pixels,
+  write_options const &options)
+{
+  size_t const initial_size = buffer.size();
+  buffer.reserve(initial_size + encoded_size_bound(props, comments, options));
+
+  auto sink = [&buffer](char const *const data, size_t const len)
+  {
+    auto const bytes = reinterpret_cast<uint8_t const *>(data);
+    buffer.insert(buffer.end(), bytes, bytes + len);
+  };
+  try
+  {
+    encode_image(sink, props, comments, pixels, options);
+  }
+  catch (...)
+  {
+    // e.g. a sample failing validation, drop the partial image
+    buffer.resize(initial_size);
+    throw;
+  }
+  return buffer.size() - initial_size;
+}
+
+pgm8::row_writer::row_writer(
+  std::ofstream &file,
+  image_properties const props,
+  std::vector<std::string> const &comments)
+  : m_file(file)
+  , m_props(props)
+{
+  validate_for_write(m_props);
+
+  std::string const header = format_header(m_props, comments);
+  m_file.write(header.data(), static_cast<std::streamsize>(header.size()));
+
+  if (m_props.get_format() != format::RAW)
+    m_block.reset(new char[s_plain_block_size]);
+  if (m_props.get_format() == format::COMPRESSED)
+    m_compressed_state.reset(new uint8_t[compressed_state_size(m_props.get_width())]());
+}
+
+pgm8::row_writer::~row_writer()
+{
+  try
+  {
+    flush_block();
+  }
+  catch (...)
+  {
+    // only if the stream throws, in which case it's been marked bad; call close() to see errors
+  }
+}
+
+size_t pgm8::row_writer::rows_remaining() const noexcept
+{
+  return static_cast<size_t>(m_props.get_height()) - m_num_rows_written;
+}
+
+void pgm8::row_writer::write_rows(uint8_t const *const rows, size_t const num_rows)
+{
+  if (num_rows > rows_remaining()) {
+    std::stringstream err{};
+    err << "too many rows, " << rows_remaining() << " remaining but " << num_rows << " given";
+    throw std::runtime_error(err.str());
+  }
+
+  size_t const width = m_props.get_width();
+
+  if (m_props.get_format() == format::RAW)
+  {
+    m_file.write(reinterpret_cast<char const *>(rows), static_cast<std::streamsize>(num_rows * width));
+  }
+  else
+  {
+    auto sink = [this](char const *const data, size_t const len)
+    {
+      m_file.write(data, static_cast<std::streamsize>(len));
+    };
+    if (m_props.get_format() == format::COMPRESSED)
+      encode_compressed_rows(
+        sink, rows, width, num_rows, m_compressed_state.get(), m_block.get(), m_block_len);
+    else // format::PLAIN
+      encode_plain_rows(sink, rows, width, num_rows, m_block.get(), m_block_len);
+  }
+
+  m_num_rows_written += num_rows;
+}
+
+void pgm8::row_writer::close()
+{
+  flush_block();
+
+  if (rows_remaining() != 0) {
+    std::stringstream err{};
+    err << "image incomplete, " << m_num_rows_written << " of " << m_props.get_height() << " rows written";
+    throw std::runtime_error(err.str());
+  }
+}
+
+void pgm8::row_writer::flush_block()
+{
+  if (m_block_len > 0) {
+    m_file.write(m_block.get(), static_cast<std::streamsize>(m_block_len));
+    m_block_len = 0;
+  }
+}
+
+pgm8::frame_reader::frame_reader(std::ifstream &file, read_options const &options)
+  : m_file(file)
+  , m_options(options)
+{}
+
+bool pgm8::frame_reader::next()
+{
+  // frames may be separated by whitespace, and PLAIN ones end with a newline
+  std::streambuf &src = *m_file.rdbuf();
+  int ch;
+  while ((ch = src.sgetc()) != std::ifstream::traits_type::eof() && is_whitespace(static_cast<unsigned char>(ch)))
+    src.sbumpc();
+  if (ch == std::ifstream::traits_type::eof()) {
+    m_file.setstate(std::ios::eofbit);
+    return false;
+  }
+
+  m_props = read_properties(m_file);
+  m_comments = read_comments(m_file);
+
+  size_t const num_pixels = m_props.num_pixels();
+  if (num_pixels > m_capacity) {
+    m_pixels.reset(new uint8_t[num_pixels]);
+    m_capacity = num_pixels;
+  }
+
+  read_pixels(m_file, m_props, m_pixels.get(), m_options);
+  if (!m_file)
+    throw std::runtime_error("unexpected end of pixel data");
+
+  ++m_num_frames_read;
+  return true;
+}
+
+pgm8::image_properties pgm8::frame_reader::get_properties() const noexcept
+{
+  return m_props;
+}
+
+std::vector<std::string> const &pgm8::frame_reader::get_comments() const noexcept
+{
+  return m_comments;
+}
+
+std::span<uint8_t const> pgm8::frame_reader::get_pixels() const noexcept
+{
+  return { m_pixels.get(), m_num_frames_read > 0 ? m_props.num_pixels() : 0 };
+}
+
+size_t pgm8::frame_reader::num_frames_read() const noexcept
+{
+  return m_num_frames_read;
+}
+
+pgm8::frame_writer::frame_writer(std::ofstream &file, write_options const &options)
+  : m_file(file)
+  , m_options(options)
+{
+  if (m_options.gzip_level != 0)
+    throw std::runtime_error("gzip_level not supported by frame_writer");
+}
+
+void pgm8::frame_writer::write(image_properties const props, uint8_t const *const pixels)
+{
+  write(props, {}, pixels);
+}
+
+void pgm8::frame_writer::write(
+  image_properties props,
+  std::vector<std::string> const &comments,
+  uint8_t const *const pixels)
+{
+  prepare_for_write(props, pixels, m_options);
+
+  auto sink = [this](char const *const data, size_t const len)
+  {
+    m_file.write(data, static_cast<std::streamsize>(len));
+  };
+
+  if (!comments.empty()) {
+    std::string const header = format_header(props, comments);
+    sink(header.data(), header.size());
+  } else {
+    bool const same_header = m_header_props
+      && props.get_width() == m_header_props->get_width()
+      && props.get_height() == m_header_props->get_height()
+      && props.get_maxval() == m_header_props->get_maxval()
+      && props.get_format() == m_header_props->get_format();
+    if (!same_header) {
+      m_header = format_header(props, {});
+      m_header_props = props;
+    }
+    sink(m_header.data(), m_header.size());
+  }
+
+  encode_raster(sink, props, pixels, m_options);
+  ++m_num_frames_written;
+}
+
+size_t pgm8::frame_writer::num_frames_written() const noexcept
+{
+  return m_num_frames_written;
+}
+
+size_t pgm8::max_encoded_size(
+  image_properties const props,
+  std::vector<std::string> const &comments)
+{
+  validate_for_write(props);
+
+  size_t const header_size = format_header(props, comments).size();
+  size_t const num_pixels = props.num_pixels();
+
+  if (props.get_format() == format::RAW)
+    return header_size + num_pixels;
+  else if (props.get_format() == format::COMPRESSED)
+    return header_size + (props.get_height() * max_compressed_row_len(props.get_width()));
+  else // format::PLAIN
+    return header_size + (num_pixels * s_plain_max_sample_len) + props.get_height();
+}
+
+std::vector<std::string> pgm8::read_comments(std::ifstream &file)
+{
+  std::vector<std::string> comments{};
+  std::string line{};
+
+  int ch = file.peek();
+  while (ch == '#') {
+    int const comment_char = file.get(); // eat #
+    assert(comment_char == '#');
+    std::getline(file, line, '\n');
+    comments.emplace_back(std::move(line));
+    ch = file.peek();
+  }
+
+  return comments;
+}
+
+size_t pgm8::skip_comments(std::ifstream &file)
+{
+  std::string line{};
+  size_t count = 0;
+
+  int ch = file.peek();
+  while (ch == '#') {
+    std::getline(file, line, '\n');
+    ++count;
+    ch = file.peek();
+  }
+
+  return count;
+}
+
+static
+uint8_t *allocate_aligned(size_t const size, size_t const alignment)
+{
+  return static_cast<uint8_t *>(::operator new(size, std::align_val_t{ alignment }));
+}
+
+static
+void free_aligned(uint8_t *const data, size_t const alignment) noexcept
+{
+  ::operator delete(data, std::align_val_t{ alignment });
+}
+
+pgm8::buffer_pool::buffer::buffer(buffer &&other) noexcept
+  : m_pool(other.m_pool)
+  , m_data(other.m_data)
+  , m_size(other.m_size)
+  , m_size_class(other.m_size_class)
+{
+  other.m_pool = nullptr;
+  other.m_data = nullptr;
+  other.m_size = 0;
+}
+
+pgm8::buffer_pool::buffer &pgm8::buffer_pool::buffer::operator=(buffer &&other) noexcept
+{
+  if (this != &other)
+  {
+    if (m_data != nullptr)
+      m_pool->release(m_data, m_size_class);
+
+    m_pool = other.m_pool;
+    m_data = other.m_data;
+    m_size = other.m_size;
+    m_size_class = other.m_size_class;
+
+    other.m_pool = nullptr;
+    other.m_data = nullptr;
+    other.m_size = 0;
+  }
+  return *this;
+}
+
+pgm8::buffer_pool::buffer::~buffer()
+{
+  if (m_data != nullptr)
+    m_pool->release(m_data, m_size_class);
+}
+
+pgm8::buffer_pool::~buffer_pool()
+{
+  trim();
+}
+
+pgm8::buffer_pool::buffer pgm8::buffer_pool::acquire(size_t const size)
+{
+  // no size class past 2^63
+  if (size > (SIZE_MAX >> 1) + 1)
+    throw std::bad_alloc();
+
+  // smallest power of two >= size, and no smaller than the alignment
+  auto const size_class = static_cast<unsigned>(std::bit_width(std::max(size, alignment) - 1));
+
+  buffer buf{};
+  buf.m_pool = this;
+  buf.m_size = size;
+  buf.m_size_class = size_class;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto &free_list = m_free[size_class];
+    if (!free_list.empty()) {
+      buf.m_data = free_list.back();
+      free_list.pop_back();
+    }
+  }
+
+  if (buf.m_data != nullptr) {
+    ++m_num_hits;
+  } else {
+    buf.m_data = allocate_aligned(size_t{1} << size_class, alignment);
+    ++m_num_misses;
+  }
+
+  return buf;
+}
+
+void pgm8::buffer_pool::release(uint8_t *const data, unsigned const size_class) noexcept
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  try
+  {
+    m_free[size_class].push_back(data);
+  }
+  catch (...)
+  {
+    // can't grow the free list, let the buffer go instead
+    free_aligned(data, alignment);
+  }
+}
+
+void pgm8::buffer_pool::trim() noexcept
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (auto &free_list : m_free)
+  {
+    for (uint8_t *const data : free_list)
+      free_aligned(data, alignment);
+    free_list.clear();
+  }
+}
+
+size_t pgm8::buffer_pool::num_hits() const noexcept { return m_num_hits; }
+size_t pgm8::buffer_pool::num_misses() const noexcept { return m_num_misses; }
+
+pgm8::arena::arena(size_t const block_size)
+  : m_block_size(block_size)
+{
+  ensure_greater_than_zero(block_size, "block_size");
+}
+
+pgm8::arena::~arena()
+{
+  for (block const &blk : m_blocks)
+    free_aligned(blk.data, alignment);
+}
+
+uint8_t *pgm8::arena::allocate(size_t const size)
+{
+  size_t const padded_size = (std::max<size_t>(size, 1) + alignment - 1) & ~(alignment - 1);
+
+  // first block from the current one on with room, blocks are kept across resets
+  for (; m_current < m_blocks.size(); ++m_current, m_offset = 0)
+  {
+    block const &blk = m_blocks[m_current];
+    if (blk.size - m_offset >= padded_size) {
+      uint8_t *const data = blk.data + m_offset;
+      m_offset += padded_size;
+      ++m_num_hits;
+      return data;
+    }
+  }
+
+  size_t const new_block_size = std::max(m_block_size, padded_size);
+  m_blocks.push_back({ allocate_aligned(new_block_size, alignment), new_block_size });
+  ++m_num_misses;
+
+  m_current = m_blocks.size() - 1;
+  m_offset = padded_size;
+  return m_blocks.back().data;
+}
+
+void pgm8::arena::reset() noexcept
+{
+  m_current = 0;
+  m_offset = 0;
+}
+
+pgm8::arena &pgm8::arena::local()
+{
+  thread_local arena instance{};
+  return instance;
+}
+
+pgm8::buffer_pool::buffer pgm8::read_pixels(
+  std::ifstream &file,
+  image_properties const props,
+  buffer_pool &pool)
+{
+  buffer_pool::buffer buf = pool.acquire(props.num_pixels());
+  read_pixels(file, props, buf.data());
+  return buf;
+}
+
+uint8_t *pgm8::read_pixels(
+  std::ifstream &file,
+  image_properties const props,
+  arena &arena)
+{
+  uint8_t *const pixels = arena.allocate(props.num_pixels());
+  read_pixels(file, props, pixels);
+  return pixels;
+}
+
+pgm8::image::image(image_properties const props, std::vector<std::string> comments)
+  : m_props(props)
+  , m_comments(std::move(comments))
+{
+  m_props.validate();
+  m_stride = (size_t{m_props.get_width()} + alignment - 1) & ~(alignment - 1);
+  size_t const size = m_stride * m_props.get_height();
+  m_data = allocate_aligned(size, alignment);
+  std::memset(m_data, 0, size);
+}
+
+pgm8::image::image(image &&other) noexcept
+  : m_props(other.m_props)
+  , m_comments(std::move(other.m_comments))
+  , m_data(other.m_data)
+  , m_stride(other.m_stride)
+{
+  other.m_data = nullptr;
+  other.m_stride = 0;
+}
+
+pgm8::image &pgm8::image::operator=(image &&other) noexcept
+{
+  if (this != &other)
+  {
+    if (m_data != nullptr)
+      free_aligned(m_data, alignment);
+
+    m_props = other.m_props;
+    m_comments = std::move(other.m_comments);
+    m_data = other.m_data;
+    m_stride = other.m_stride;
+
+    other.m_data = nullptr;
+    other.m_stride = 0;
+  }
+  return *this;
+}
+
+pgm8::image::~image()
+{
+  if (m_data != nullptr)
+    free_aligned(m_data, alignment);
+}
+
+pgm8::image pgm8::read(std::string const &path)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open())
+    throw std::runtime_error("failed to open file");
+
+  if (is_gzip(file))
+  {
+#if PGM8_ZLIB
+    gzip_source src(file);
+    header const hdr = read_gzip_header(src);
+    image img(hdr.get_properties(), copy_comments(hdr));
+    read_gzip_pixels(src, img.get_properties(), [&img](size_t const r) { return img.row(r); });
+    src.skip_rest();
+    return img;
+#else
+    throw std::runtime_error(s_gzip_unsupported);
+#endif
+  }
+
+  image_properties const props = read_properties(file);
+  image img(props, read_comments(file));
+
+  row_reader reader(file, props);
+  for (size_t r = 0; r < props.get_height(); ++r)
+    reader.read_rows(img.row(r), 1);
+
+  return img;
+}
+
+void pgm8::write(std::string const &path, image const &img)
+{
+  std::ofstream file(path, std::ios::binary);
+  if (!file.is_open())
+    throw std::runtime_error("failed to open file");
+
+  image_properties const props = img.get_properties();
+  row_writer writer(file, props, img.get_comments());
+  for (size_t r = 0; r < props.get_height(); ++r)
+    writer.write_rows(img.row(r), 1);
+  writer.close();
+
+  if (!file)
+    throw std::runtime_error("failed to write file");
+}
+
+#if PGM8_POSIX
+
+// Writes all of `iov`, retrying after partial writes.
+static
+void writev_all(int const fd, iovec *iov, int num_iov)
+{
+  while (num_iov > 0)
+  {
+    ssize_t const result = ::writev(fd, iov, num_iov);
+    if (result == -1) {
+      if (errno == EINTR)
+        continue;
+      throw make_errno_error("failed to write file");
+    }
+
+    auto num_written = static_cast<size_t>(result);
+    while (num_iov > 0 && num_written >= iov->iov_len) {
+      num_written -= iov->iov_len;
+      ++iov;
+      --num_iov;
+    }
+    if (num_iov > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + num_written;
+      iov->iov_len -= num_written;
+    }
+  }
+}
+
+// Sink for encode_image writing to a file descriptor. The header, always the
+// first thing sunk, is held back and written along with the first block of
+// pixels, so a RAW image takes a single writev. finish() writes it if nothing
+// followed, as when gzipped output comes in one piece.
+struct fd_sink
+{
+  int fd;
+  std::string header{};
+  bool header_seen = false;
+  uint64_t num_written = 0;
+
+  void operator()(char const *const data, size_t const len)
+  {
+    if (!header_seen) {
+      header.assign(data, len);
+      header_seen = true;
+      return;
+    }
+
+    iovec iov[2] {
+      { header.data(), header.size() },
+      { const_cast<char *>(data), len },
+    };
+    bool const skip_header = header.empty();
+    writev_all(fd, iov + skip_header, 2 - skip_header);
+
+    num_written += header.size() + len;
+    header.clear();
+  }
+
+  void finish()
+  {
+    if (header.empty())
+      return;
+    iovec iov{ header.data(), header.size() };
+    writev_all(fd, &iov, 1);
+    num_written += header.size();
+    header.clear();
+  }
+};
+
+// Reserves `size` bytes for the file, where the filesystem supports it.
+static
+void preallocate(int const fd, off_t const size)
+{
+#ifdef __APPLE__
+  // no posix_fallocate, reserve the space without changing the file's size
+  fstore_t store{};
+  store.fst_flags = F_ALLOCATEALL;
+  store.fst_posmode = F_PEOFPOSMODE;
+  store.fst_offset = 0;
+  store.fst_length = size;
+  if (::fcntl(fd, F_PREALLOCATE, &store) == -1 && errno != ENOTSUP)
+    throw make_errno_error("failed to preallocate file");
+#else
+  int const err = ::posix_fallocate(fd, 0, size);
+  if (err != 0 && err != EOPNOTSUPP && err != EINVAL) {
+    errno = err;
+    throw make_errno_error("failed to preallocate file");
+  }
+#endif
+}
+
+#ifdef O_DIRECT
+
+// Sink for encode_image writing to a file descriptor opened with O_DIRECT.
+// Output is staged in an aligned buffer and written in whole blocks; finish()
+// pads the last block and truncates the file back to the real size.
+class direct_sink
+{
+public:
+  static constexpr size_t alignment = 4096;
+  static constexpr size_t block_size = 1024 * 1024;
+
+  explicit direct_sink(int const fd)
+    : m_fd(fd)
+    , m_block(allocate_aligned(block_size, alignment))
+  {}
+
+  direct_sink(direct_sink const &) = delete;
+  direct_sink &operator=(direct_sink const &) = delete;
+
+  ~direct_sink()
+  {
+    free_aligned(m_block, alignment);
+  }
+
+  void operator()(char const *data, size_t len)
+  {
+    while (len > 0)
+    {
+      size_t const count = std::min(len, block_size - m_block_len);
+      std::memcpy(m_block + m_block_len, data, count);
+      m_block_len += count;
+      data += count;
+      len -= count;
+
+      if (m_block_len == block_size)
+        write_block(block_size);
+    }
+  }
+
+  // Returns the number of bytes in the file.
+  uint64_t finish()
+  {
+    uint64_t const size = m_offset + m_block_len;
+    if (m_block_len > 0)
+    {
+      size_t const padded_len = (m_block_len + alignment - 1) / alignment * alignment;
+      std::memset(m_block + m_block_len, 0, padded_len - m_block_len);
+      write_block(padded_len);
+    }
+    if (::ftruncate(m_fd, static_cast<off_t>(size)) == -1)
+      throw make_errno_error("failed to truncate file");
+    return size;
+  }
+
+private:
+  void write_block(size_t const len)
+  {
+    for (size_t done = 0; done < len; )
+    {
+      ssize_t const result = ::pwrite(m_fd, m_block + done, len - done, static_cast<off_t>(m_offset + done));
+      if (result == -1) {
+        if (errno == EINTR)
+          continue;
+        throw make_errno_error("failed to write file");
+      }
+      done += static_cast<size_t>(result);
+    }
+    m_offset += len;
+    m_block_len = 0;
+  }
+
+  int m_fd;
+  uint8_t *m_block;
+  size_t m_block_len = 0;
+  uint64_t m_offset = 0;
+};
+
+#endif // O_DIRECT
+
+#endif // PGM8_POSIX
+
+void pgm8::write(
+  std::string const &path,
+  image_properties const props,
+  std::vector<std::string> const &comments,
+  uint8_t const *const pixels,
+  write_options const &options)
+{
+#if PGM8_POSIX
+  int constexpr flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  int fd = -1;
+  bool direct = false;
+
+#ifdef O_DIRECT
+  if (options.direct_io) {
+    fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+    direct = fd != -1;
+    // EINVAL means the filesystem doesn't support direct I/O
+    if (fd == -1 && errno != EINVAL)
+      throw make_errno_error("failed to open file");
+  }
+#endif
+  if (fd == -1) {
+    fd = ::open(path.c_str(), flags, 0644);
+    if (fd == -1)
+      throw make_errno_error("failed to open file");
+  }
+
+  try
+  {
+    if (options.preallocate)
+      preallocate(fd, static_cast<off_t>(encoded_size_bound(props, comments, options)));
+
+#ifdef O_DIRECT
+    if (direct) {
+      direct_sink sink(fd);
+      encode_image(sink, props, comments, pixels, options);
+      sink.finish();
+    } else
+#endif
+    {
+      fd_sink sink{ fd };
+      encode_image(sink, props, comments, pixels, options);
+      sink.finish();
+      // PLAIN and gzipped output can come in under the preallocated bound
+      if (options.preallocate && ::ftruncate(fd, static_cast<off_t>(sink.num_written)) == -1)
+        throw make_errno_error("failed to truncate file");
+    }
+  }
+  catch (...)
+  {
+    // don't leave a partial image behind, preallocated ones look complete
+    static_cast<void>(::ftruncate(fd, 0));
+    ::close(fd);
+    throw;
+  }
+
+  if (::close(fd) == -1)
+    throw make_errno_error("failed to close file");
+#else
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file.is_open())
+    throw std::runtime_error("failed to open file");
+
+  try
+  {
+    write(file, props, comments, pixels, options);
+  }
+  catch (...)
+  {
+    file.close();
+    std::error_code ec{};
+    std::filesystem::resize_file(path, 0, ec);
+    throw;
+  }
+  if (!file)
+    throw std::runtime_error("failed to write file");
+#endif
+}
+
+static
+char const *as_chars(std::span<uint8_t const> const buffer) noexcept
+{
+  return reinterpret_cast<char const *>(buffer.data());
+}
+
+pgm8::image_properties pgm8::read_properties(
+  std::span<uint8_t const> const buffer,
+  size_t &num_consumed)
+{
+  char const *const begin = as_chars(buffer);
+  return parse_properties(begin, begin + buffer.size(), num_consumed);
+}
+
+std::vector<std::string> pgm8::read_comments(
+  std::span<uint8_t const> const buffer,
+  size_t &num_consumed)
+{
+  char const *const begin = as_chars(buffer);
+  std::vector<std::string> comments{};
+  num_consumed = parse_comments(begin, begin + buffer.size(), [&comments](char const *const b, char const *const e)
+  {
+    comments.emplace_back(b, e);
+  });
+  return comments;
+}
+
+size_t pgm8::skip_comments(
+  std::span<uint8_t const> const buffer,
+  size_t &num_consumed)
+{
+  char const *const begin = as_chars(buffer);
+  size_t count = 0;
+  num_consumed = parse_comments(begin, begin + buffer.size(), [&count](char const *, char const *)
+  {
+    ++count;
+  });
+  return count;
+}
+
+size_t pgm8::read_pixels(
+  std::span<uint8_t const> const buffer,
+  image_properties const props,
+  uint8_t *const pixels)
+{
+  size_t const num_pixels = props.num_pixels();
+
+  if (props.get_format() == format::RAW)
+  {
+    if (buffer.size() < num_pixels)
+      throw std::runtime_error("unexpected end of pixel data");
+    std::memcpy(pixels, buffer.data(), num_pixels);
+    return num_pixels;
+  }
+  else if (props.get_format() == format::COMPRESSED)
+  {
+    char const *const begin = as_chars(buffer);
+    std::unique_ptr<uint8_t []> prev_row(new uint8_t[props.get_width()]());
+    internal::compressed_decoder decoder{ pixels, props.get_width(), props.get_height(), prev_row.get() };
+    size_t const num_consumed = decoder.feed(begin, begin + buffer.size());
+    decoder.finish();
+    return num_consumed;
+  }
+  else // format::PLAIN
+  {
+    char const *const begin = as_chars(buffer);
+    internal::plain_decoder decoder{ pixels, num_pixels };
+    size_t const num_consumed = decoder.feed(begin, begin + buffer.size());
+    if (!decoder.done())
+      decoder.finish();
+    return num_consumed;
+  }
+}
+
+size_t pgm8::read_pixels(
+  std::span<uint8_t const> const buffer,
+  image_properties const props,
+  uint8_t *const pixels,
+  read_options const &options)
+{
+  unsigned const num_threads = resolve_num_threads(options.num_threads);
+  decode_pass const pass(props, options);
+
+  if (props.get_format() != format::PLAIN || num_threads == 1)
+  {
+    if (pass.empty())
+      return read_pixels(buffer, props, pixels);
+
+    size_t const num_pixels = props.num_pixels();
+
+    if (props.get_format() == format::RAW)
+    {
+      if (buffer.size() < num_pixels)
+        throw std::runtime_error("unexpected end of pixel data");
+      for (size_t pos = 0; pos < num_pixels; pos += s_plain_block_size) {
+        size_t const count = std::min(s_plain_block_size, num_pixels - pos);
+        std::memcpy(pixels + pos, buffer.data() + pos, count);
+        pass.apply(pixels + pos, count, pos);
+      }
+      return num_pixels;
+    }
+    else if (props.get_format() == format::COMPRESSED)
+    {
+      char const *const begin = as_chars(buffer);
+      char const *const end = begin + buffer.size();
+      size_t const width = props.get_width();
+      std::unique_ptr<uint8_t []> prev_row(new uint8_t[width]());
+      internal::compressed_decoder decoder{ pixels, width, props.get_height(), prev_row.get() };
+
+      char const *p = begin;
+      while (!decoder.done() && p < end) {
+        size_t const first = decoder.num_rows_decoded * width;
+        p += decoder.feed(p, p + std::min(s_plain_block_size, static_cast<size_t>(end - p)));
+        pass.apply(pixels + first, (decoder.num_rows_decoded * width) - first, first);
+      }
+      decoder.finish();
+      return static_cast<size_t>(p - begin);
+    }
+    else // format::PLAIN
+    {
+      char const *const begin = as_chars(buffer);
+      char const *const end = begin + buffer.size();
+      internal::plain_decoder decoder{ pixels, num_pixels };
+
+      char const *p = begin;
+      while (!decoder.done() && p < end) {
+        size_t const first = decoder.num_decoded;
+        p += decoder.feed(p, p + std::min(s_plain_block_size, static_cast<size_t>(end - p)));
+        pass.apply(pixels + first, decoder.num_decoded - first, first);
+      }
+      if (!decoder.done()) {
+        size_t const first = decoder.num_decoded;
+        decoder.finish();
+        pass.apply(pixels + first, decoder.num_decoded - first, first);
+      }
+      return static_cast<size_t>(p - begin);
+    }
+  }
+
+  ensure_greater_than_zero(options.chunk_size, "chunk_size");
+  // room for at least one token per chunk
+  size_t const chunk_size = std::max(options.chunk_size, s_plain_max_sample_len);
+
+  size_t const num_pixels = props.num_pixels();
+  char const *const begin = as_chars(buffer);
+  auto const res = decode_plain_parallel(
+    begin, begin + buffer.size(), pixels, num_pixels, 0, num_threads, chunk_size,
+    pass.empty() ? nullptr : &pass);
+
+  if (res.num_decoded < num_pixels) {
+    std::stringstream err{};
+    err << "unexpected end of pixel data, read " << res.num_decoded << " of " << num_pixels << " pixels";
+    throw std::runtime_error(err.str());
+  }
+
+  return res.num_consumed;
+}
+
+// Calls `fn(task)` for every task in [0, num_tasks) on `num_threads` workers.
+// Tasks are dealt round-robin into per-worker queues. A worker takes the lowest
+// task from its own queue and, once that's empty, steals the highest task from
+// another worker's queue. If tasks throw, the first exception caught is
+// rethrown once all workers are done.
+template <typename Fn>
+void work_stealing_for(size_t const num_tasks, unsigned const num_threads, Fn const &fn)
+{
+  struct worker_queue
+  {
+    std::mutex mutex;
+    std::deque<size_t> tasks;
+  };
+
+  size_t const num_workers = std::max<size_t>(1, std::min<size_t>(num_threads, num_tasks));
+  std::vector<worker_queue> queues(num_workers);
+  for (size_t task = 0; task < num_tasks; ++task)
+    queues[task % num_workers].tasks.push_back(task);
+
+  std::mutex error_mutex;
+  std::exception_ptr first_error{};
+
+  auto const take_task = [&](size_t const self, size_t &task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(queues[self].mutex);
+      if (!queues[self].tasks.empty()) {
+        task = queues[self].tasks.front();
+        queues[self].tasks.pop_front();
+        return true;
+      }
+    }
+    for (size_t offset = 1; offset < num_workers; ++offset)
+    {
+      worker_queue &victim = queues[(self + offset) % num_workers];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        task = victim.tasks.back();
+        victim.tasks.pop_back();
+        return true;
+      }
+    }
+    return false;
+  };
+
+  auto const work = [&](size_t const self)
+  {
+    for (size_t task; take_task(self, task); )
+    {
+      try { fn(task); }
+      catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!first_error)
+          first_error = std::current_exception();
+      }
+    }
+  };
+
+  std::vector<std::thread> helpers{};
+  helpers.reserve(num_workers - 1);
+  for (size_t i = 1; i < num_workers; ++i)
+    helpers.emplace_back(work, i);
+  work(0);
+  for (auto &helper : helpers)
+    helper.join();
+
+  if (first_error)
+    std::rethrow_exception(first_error);
+}
+
+// Decodes the file at `path` into `item`, calling `before_alloc(num_pixels)`
+// once the header is known. Failures are stored in `item.error`.
+template <typename BeforeAlloc>
+void decode_batch_file(
+  std::string const &path,
+  pgm8::batch_item &item,
+  BeforeAlloc const &before_alloc)
+{
+  try
+  {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+      throw std::runtime_error("failed to open file");
+
+    if (is_gzip(file))
+    {
+#if PGM8_ZLIB
+      gzip_source src(file);
+      pgm8::header const hdr = read_gzip_header(src);
+      item.props = hdr.get_properties();
+      item.comments = copy_comments(hdr);
+
+      before_alloc(item.props.num_pixels());
+
+      size_t const width = item.props.get_width();
+      item.pixels.reset(new uint8_t[item.props.num_pixels()]);
+      read_gzip_pixels(src, item.props, [&item, width](size_t const r) { return item.pixels.get() + (r * width); });
+      src.skip_rest();
+      return;
+#else
+      throw std::runtime_error(s_gzip_unsupported);
+#endif
+    }
+
+    item.props = pgm8::read_properties(file);
+    item.comments = pgm8::read_comments(file);
+
+    before_alloc(item.props.num_pixels());
+
+    item.pixels.reset(new uint8_t[item.props.num_pixels()]);
+    pgm8::read_pixels(file, item.props, item.pixels.get());
+    if (!file)
+      throw std::runtime_error("unexpected end of pixel data");
+  }
+  catch (...)
+  {
+    item.error = std::current_exception();
+    item.pixels.reset();
+  }
+}
+
+void pgm8::read_batch(
+  std::vector<std::string> const &paths,
+  std::function<void (batch_item &&)> const &callback,
+  batch_options const &options)
+{
+  bool const in_order = options.order == batch_order::INPUT;
+
+  std::mutex mutex;
+  std::condition_variable budget_freed;
+  size_t in_flight_bytes = 0;
+  size_t next_to_deliver = 0;
+  std::map<size_t, batch_item> pending{};
+  std::exception_ptr callback_error{};
+
+  // Waits until `bytes` fit in the budget. The oldest undelivered file in
+  // INPUT order is always let through, as every later item waits on it.
+  auto const acquire = [&](size_t const index, size_t const bytes)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    budget_freed.wait(lock, [&]()
+    {
+      return options.max_in_flight_bytes == 0
+        || in_flight_bytes == 0
+        || in_flight_bytes + bytes <= options.max_in_flight_bytes
+        || (in_order && index == next_to_deliver)
+        || callback_error;
+    });
+    in_flight_bytes += bytes;
+  };
+
+  // with `mutex` held
+  auto const deliver = [&](batch_item &&item)
+  {
+    size_t const bytes = item.pixels ? item.props.num_pixels() : 0;
+    if (!callback_error)
+    {
+      try { callback(std::move(item)); }
+      catch (...) { callback_error = std::current_exception(); }
+    }
+    in_flight_bytes -= bytes;
+  };
+
+  work_stealing_for(paths.size(), resolve_num_threads(options.num_threads), [&](size_t const index)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (callback_error)
+        return;
+    }
+
+    batch_item item{};
+    item.index = index;
+    bool acquired = false;
+
+    decode_batch_file(paths[index], item, [&](size_t const num_pixels)
+    {
+      acquire(index, num_pixels);
+      acquired = true;
+    });
+
+    if (item.error && acquired) {
+      std::lock_guard<std::mutex> lock(mutex);
+      in_flight_bytes -= item.props.num_pixels();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      if (in_order)
+      {
+        pending.emplace(index, std::move(item));
+        for (auto it = pending.find(next_to_deliver); it != pending.end(); it = pending.find(next_to_deliver))
+        {
+          deliver(std::move(it->second));
+          pending.erase(it);
+          ++next_to_deliver;
+        }
+      }
+      else
+      {
+        deliver(std::move(item));
+      }
+    }
+    budget_freed.notify_all();
+  });
+
+  if (callback_error)
+    std::rethrow_exception(callback_error);
+}
+
+std::vector<pgm8::batch_item> pgm8::read_batch(
+  std::vector<std::string> const &paths,
+  batch_options const &options)
+{
+  std::vector<batch_item> items(paths.size());
+
+  batch_options opts = options;
+  // everything is kept, so there's nothing to wait for
+  opts.max_in_flight_bytes = 0;
+
+  read_batch(paths, [&items](batch_item &&item)
+  {
+    size_t const index = item.index;
+    items[index] = std::move(item);
+  }, opts);
+
+  return items;
+}
+
+#if PGM8_IO_URING
+
+namespace {
+
+// Minimal io_uring submission/completion ring driven through raw syscalls.
+class uring
+{
+public:
+  uring() = default;
+  uring(uring const &) = delete;
+  uring &operator=(uring const &) = delete;
+
+  ~uring()
+  {
+    if (m_sqes != nullptr) ::munmap(m_sqes, m_sqes_len);
+    if (m_cq_ptr != nullptr && m_cq_ptr != m_sq_ptr) ::munmap(m_cq_ptr, m_cq_len);
+    if (m_sq_ptr != nullptr) ::munmap(m_sq_ptr, m_sq_len);
+    if (m_fd != -1) ::close(m_fd);
+  }
+
+  // Returns false if io_uring isn't available.
+  bool init(unsigned const entries)
+  {
+    io_uring_params params{};
+    long const fd = ::syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+      return false;
+    m_fd = static_cast<int>(fd);
+
+    m_sq_len = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+    m_cq_len = params.cq_off.cqes + (params.cq_entries * sizeof(io_uring_cqe));
+    bool const single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap)
+      m_sq_len = m_cq_len = std::max(m_sq_len, m_cq_len);
+
+    m_sq_ptr = map(m_sq_len, IORING_OFF_SQ_RING);
+    if (m_sq_ptr == nullptr)
+      return false;
+    m_cq_ptr = single_mmap ? m_sq_ptr : map(m_cq_len, IORING_OFF_CQ_RING);
+    if (m_cq_ptr == nullptr)
+      return false;
+    m_sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = static_cast<io_uring_sqe *>(map(m_sqes_len, IORING_OFF_SQES));
+    if (m_sqes == nullptr)
+      return false;
+
+    auto const sq = static_cast<char *>(m_sq_ptr);
+    m_sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    m_sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    m_sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+    auto const cq = static_cast<char *>(m_cq_ptr);
+    m_cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    m_cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    m_cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    return true;
+  }
+
+  // Queues a request, the caller never has more than `entries` outstanding.
+  void push(io_uring_sqe const &sqe) noexcept
+  {
+    unsigned const tail = *m_sq_tail;
+    unsigned const idx = tail & m_sq_mask;
+    m_sqes[idx] = sqe;
+    m_sq_array[idx] = idx;
+    std::atomic_ref<unsigned>(*m_sq_tail).store(tail + 1, std::memory_order_release);
+    ++m_num_unsubmitted;
+  }
+
+  // Submits queued requests and waits for at least one completion.
+  void submit_and_wait()
+  {
+    for (;;)
+    {
+      long const res = ::syscall(
+        __NR_io_uring_enter, m_fd, m_num_unsubmitted, 1u, IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (res >= 0) {
+        m_num_unsubmitted -= std::min(m_num_unsubmitted, static_cast<unsigned>(res));
+        return;
+      }
+      if (errno != EINTR)
+        throw make_errno_error("io_uring_enter failed");
+    }
+  }
+
+  bool pop(io_uring_cqe &out) noexcept
+  {
+    unsigned const head = *m_cq_head;
+    if (head == std::atomic_ref<unsigned>(*m_cq_tail).load(std::memory_order_acquire))
+      return false;
+    out = m_cqes[head & m_cq_mask];
+    std::atomic_ref<unsigned>(*m_cq_head).store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  void *map(size_t const len, unsigned long long const offset) noexcept
+  {
+    void *const ptr = ::mmap(
+      nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, static_cast<off_t>(offset));
+    return (ptr == MAP_FAILED) ? nullptr : ptr;
+  }
+
+  int m_fd = -1;
+  void *m_sq_ptr = nullptr, *m_cq_ptr = nullptr;
+  size_t m_sq_len = 0, m_cq_len = 0, m_sqes_len = 0;
+  io_uring_sqe *m_sqes = nullptr;
+  unsigned *m_sq_tail = nullptr, *m_sq_array = nullptr;
+  unsigned m_sq_mask = 0, m_num_unsubmitted = 0;
+  unsigned *m_cq_head = nullptr, *m_cq_tail = nullptr;
+  unsigned m_cq_mask = 0;
+  io_uring_cqe *m_cqes = nullptr;
+};
+
+// One file being read by read_batch_async.
+struct async_slot
+{
+  enum class phase : uint8_t { IDLE, OPENING, READING_HEADER, READING_RAW, READING_PLAIN };
+
+  async_slot() = default;
+  async_slot(async_slot const &) = delete;
+  async_slot &operator=(async_slot const &) = delete;
+
+  ~async_slot()
+  {
+    if (fd != -1)
+      ::close(fd);
+  }
+
+  phase state = phase::IDLE;
+  int fd = -1;
+  uint64_t offset = 0;
+  size_t num_raster_read = 0;
+  std::unique_ptr<char []> block{};
+  pgm8::internal::plain_decoder decoder{ nullptr, 0 };
+  pgm8::batch_item item{};
+};
+
+// Size of the first read of each file, which must cover the header.
+static constexpr size_t s_async_header_read_size = 4096;
+
+static
+bool read_batch_uring(
+  std::vector<std::string> const &paths,
+  std::function<void (pgm8::batch_item &&)> const &callback,
+  pgm8::async_read_options const &options)
+{
+  using pgm8::batch_item;
+  using phase = async_slot::phase;
+
+  unsigned const queue_depth = std::max(1u, options.queue_depth);
+
+  uring ring;
+  if (!ring.init(queue_depth))
+    return false;
+
+  std::vector<async_slot> slots(std::min<size_t>(queue_depth, paths.size()));
+  std::vector<size_t> free_slots{};
+  for (size_t i = slots.size(); i > 0; --i)
+    free_slots.push_back(i - 1);
+
+  size_t next_path = 0;
+  size_t num_in_flight = 0;
+  std::exception_ptr callback_error{};
+
+  auto const submit_read = [&ring, &num_in_flight](size_t const slot_idx, int const fd, void *const dst, size_t const len, uint64_t const offset)
+  {
+    io_uring_sqe sqe{};
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uint64_t>(dst);
+    sqe.len = static_cast<uint32_t>(std::min<size_t>(len, UINT32_MAX));
+    sqe.off = offset;
+    sqe.user_data = slot_idx;
+    ring.push(sqe);
+    ++num_in_flight;
+  };
+
+  auto const finish = [&](size_t const slot_idx)
+  {
+    async_slot &slot = slots[slot_idx];
+    if (slot.fd != -1) {
+      ::close(slot.fd);
+      slot.fd = -1;
+    }
+    if (slot.item.error)
+      slot.item.pixels.reset();
+    if (!callback_error)
+    {
+      try { callback(std::move(slot.item)); }
+      catch (...) { callback_error = std::current_exception(); }
+    }
+    slot.item = batch_item{};
+    slot.state = phase::IDLE;
+    free_slots.push_back(slot_idx);
+  };
+
+  auto const fail = [&](size_t const slot_idx, std::exception_ptr err)
+  {
+    slots[slot_idx].item.error = std::move(err);
+    finish(slot_idx);
+  };
+
+  auto const fail_errno = [&](size_t const slot_idx, char const *const what, int const err)
+  {
+    std::stringstream msg{};
+    msg << what << ": " << std::strerror(err);
+    fail(slot_idx, std::make_exception_ptr(std::runtime_error(msg.str())));
+  };
+
+  // for headers that don't fit in the first read, or kernels without async open
+  auto const decode_synchronously = [&](size_t const slot_idx)
+  {
+    async_slot &slot = slots[slot_idx];
+    size_t const index = slot.item.index;
+    slot.item = batch_item{};
+    slot.item.index = index;
+    decode_batch_file(paths[index], slot.item, [](size_t) {});
+    finish(slot_idx);
+  };
+
+  // Returns true once the image is fully decoded.
+  auto const feed_plain = [](async_slot &slot, char const *const begin, char const *const end)
+  {
+    slot.decoder.feed(begin, end);
+    return slot.decoder.done();
+  };
+
+  auto const on_header = [&](size_t const slot_idx, size_t const num_read)
+  {
+    async_slot &slot = slots[slot_idx];
+    char const *const begin = slot.block.get();
+    char const *const end = begin + num_read;
+    bool const may_be_truncated = (num_read == s_async_header_read_size);
+
+    // gzip is inflated on the decoding thread
+    if (num_read >= 2 && static_cast<unsigned char>(begin[0]) == 0x1f && static_cast<unsigned char>(begin[1]) == 0x8b) {
+      decode_synchronously(slot_idx);
+      return;
+    }
+
+    size_t header_len = 0;
+    try
+    {
+      auto const collect = [&slot](char const *const b, char const *const e)
+      {
+        slot.item.comments.emplace_back(b, e);
+      };
+      slot.item.comments.clear();
+      slot.item.props = parse_properties(begin, end, header_len, collect);
+      header_len += parse_comments(begin + header_len, end, collect);
+    }
+    catch (...)
+    {
+      if (may_be_truncated)
+        decode_synchronously(slot_idx);
+      else
+        fail(slot_idx, std::current_exception());
+      return;
+    }
+
+    // COMPRESSED is rare enough not to warrant its own asynchronous path
+    if ((may_be_truncated && header_len == num_read) ||
+        slot.item.props.get_format() == pgm8::format::COMPRESSED) {
+      decode_synchronously(slot_idx);
+      return;
+    }
+
+    size_t const num_pixels = slot.item.props.num_pixels();
+    slot.item.pixels.reset(new uint8_t[num_pixels]);
+
+    if (slot.item.props.get_format() == pgm8::format::RAW)
+    {
+      size_t const num_have = std::min(num_read - header_len, num_pixels);
+      std::memcpy(slot.item.pixels.get(), begin + header_len, num_have);
+      slot.num_raster_read = num_have;
+
+      if (num_have == num_pixels) {
+        finish(slot_idx);
+        return;
+      }
+      if (!may_be_truncated) {
+        fail(slot_idx, std::make_exception_ptr(std::runtime_error("unexpected end of pixel data")));
+        return;
+      }
+
+      // the rest of the raster goes straight into the pixel buffer
+      slot.state = phase::READING_RAW;
+      slot.offset = num_read;
+      submit_read(slot_idx, slot.fd, slot.item.pixels.get() + num_have, num_pixels - num_have, slot.offset);
+    }
+    else // format::PLAIN
+    {
+      slot.decoder = pgm8::internal::plain_decoder{ slot.item.pixels.get(), num_pixels };
+      try
+      {
+        if (feed_plain(slot, begin + header_len, end)) {
+          finish(slot_idx);
+          return;
+        }
+        if (!may_be_truncated) {
+          slot.decoder.finish();
+          finish(slot_idx);
+          return;
+        }
+      }
+      catch (...)
+      {
+        fail(slot_idx, std::current_exception());
+        return;
+      }
+
+      slot.state = phase::READING_PLAIN;
+      slot.offset = num_read;
+      submit_read(slot_idx, slot.fd, slot.block.get(), s_plain_block_size, slot.offset);
+    }
+  };
+
+  auto const on_completion = [&](size_t const slot_idx, int const res)
+  {
+    async_slot &slot = slots[slot_idx];
+
+    switch (slot.state)
+    {
+      case phase::OPENING:
+        if (res == -EINVAL) {
+          // no IORING_OP_OPENAT on this kernel
+          decode_synchronously(slot_idx);
+          return;
+        }
+        if (res < 0) {
+          fail_errno(slot_idx, "failed to open file", -res);
+          return;
+        }
+        slot.fd = res;
+        slot.state = phase::READING_HEADER;
+        submit_read(slot_idx, slot.fd, slot.block.get(), s_async_header_read_size, 0);
+        return;
+
+      case phase::READING_HEADER:
+        if (res < 0) {
+          fail_errno(slot_idx, "failed to read file", -res);
+          return;
+        }
+        on_header(slot_idx, static_cast<size_t>(res));
+        return;
+
+      case phase::READING_RAW:
+      {
+        if (res <= 0) {
+          if (res < 0) fail_errno(slot_idx, "failed to read file", -res);
+          else fail(slot_idx, std::make_exception_ptr(std::runtime_error("unexpected end of pixel data")));
+          return;
+        }
+        slot.num_raster_read += static_cast<size_t>(res);
+        slot.offset += static_cast<uint64_t>(res);
+        size_t const num_pixels = slot.item.props.num_pixels();
+        if (slot.num_raster_read == num_pixels) {
+          finish(slot_idx);
+          return;
+        }
+        // short read, continue where it stopped
+        submit_read(
+          slot_idx, slot.fd,
+          slot.item.pixels.get() + slot.num_raster_read,
+          num_pixels - slot.num_raster_read,
+          slot.offset);
+        return;
+      }
+
+      case phase::READING_PLAIN:
+        if (res < 0) {
+          fail_errno(slot_idx, "failed to read file", -res);
+          return;
+        }
+        try
+        {
+          bool const done = (res == 0)
+            ? (slot.decoder.finish(), true)
+            : feed_plain(slot, slot.block.get(), slot.block.get() + res);
+          if (done) {
+            finish(slot_idx);
+            return;
+          }
+        }
+        catch (...)
+        {
+          fail(slot_idx, std::current_exception());
+          return;
+        }
+        slot.offset += static_cast<uint64_t>(res);
+        submit_read(slot_idx, slot.fd, slot.block.get(), s_plain_block_size, slot.offset);
+        return;
+
+      case phase::IDLE:
+      default:
+        return;
+    }
+  };
+
+  // Waits out every request still in the kernel, which would otherwise
+  // complete into slot buffers freed by the unwind.
+  auto const drain = [&]()
+  {
+    auto const discard = [&](io_uring_cqe const &cqe)
+    {
+      --num_in_flight;
+      if (slots[cqe.user_data].state == phase::OPENING && cqe.res >= 0)
+        ::close(cqe.res);
+    };
+
+    for (io_uring_cqe cqe; ring.pop(cqe); )
+      discard(cqe);
+    while (num_in_flight > 0)
+    {
+      ring.submit_and_wait();
+      for (io_uring_cqe cqe; ring.pop(cqe); )
+        discard(cqe);
+    }
+  };
+
+  try
+  {
+    for (;;)
+    {
+      // keep the queue full
+      while (!callback_error && next_path < paths.size() && !free_slots.empty())
+      {
+        size_t const slot_idx = free_slots.back();
+        free_slots.pop_back();
+
+        async_slot &slot = slots[slot_idx];
+        if (!slot.block)
+          slot.block.reset(new char[std::max(s_plain_block_size, s_async_header_read_size)]);
+        slot.item.index = next_path;
+        slot.state = phase::OPENING;
+        slot.offset = 0;
+        slot.num_raster_read = 0;
+
+        io_uring_sqe sqe{};
+        sqe.opcode = IORING_OP_OPENAT;
+        sqe.fd = AT_FDCWD;
+        sqe.addr = reinterpret_cast<uint64_t>(paths[next_path].c_str());
+        sqe.open_flags = O_RDONLY | O_CLOEXEC;
+        sqe.user_data = slot_idx;
+        ring.push(sqe);
+        ++num_in_flight;
+
+        ++next_path;
+      }
+
+      if (slots.size() == free_slots.size())
+        break;
+
+      ring.submit_and_wait();
+
+      for (io_uring_cqe cqe; ring.pop(cqe); )
+      {
+        --num_in_flight;
+        on_completion(static_cast<size_t>(cqe.user_data), cqe.res);
+      }
+    }
+  }
+  catch (...)
+  {
+    try
+    {
+      drain();
+    }
+    catch (...)
+    {
+      // there's no telling when the kernel is done with them, so leak them
+      for (async_slot &slot : slots) {
+        static_cast<void>(slot.block.release());
+        static_cast<void>(slot.item.pixels.release());
+      }
+    }
+    throw;
+  }
+
+  if (callback_error)
+    std::rethrow_exception(callback_error);
+  return true;
+}
+
+} // namespace
+
+#endif // PGM8_IO_URING
+
+bool pgm8::read_batch_async(
+  std::vector<std::string> const &paths,
+  std::function<void (batch_item &&)> const &callback,
+  async_read_options const &options)
+{
+#if PGM8_IO_URING
+  if (!options.force_fallback && read_batch_uring(paths, callback, options))
+    return true;
+#endif
+
+  read_batch(paths, callback, {
+    .num_threads = options.fallback_num_threads,
+    .order = batch_order::COMPLETION,
+  });
+  return false;
+}
+
+static
+uint64_t fnv1a(std::string_view const str) noexcept
+{
+  uint64_t hash = 0xcbf29ce484222325;
+  for (char const ch : str) {
+    hash ^= static_cast<unsigned char>(ch);
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+// The index files below find records by name through a table of buckets, a
+// power of two more than the number of records. Each bucket holds a record
+// index + 1, or 0 when empty; collisions are resolved by linear probing.
+
+static
+void insert_bucket(std::vector<uint32_t> &buckets, std::string_view const key, size_t const idx) noexcept
+{
+  uint64_t const mask = buckets.size() - 1;
+  uint64_t pos = fnv1a(key) & mask;
+  while (buckets[pos] != 0)
+    pos = (pos + 1) & mask;
+  buckets[pos] = static_cast<uint32_t>(idx + 1);
+}
+
+// Returns the index + 1 of the record whose key (given by `key_of(idx)`) is `key`, or 0.
+template <typename KeyOf>
+uint32_t find_bucket(
+  uint32_t const *const buckets,
+  uint32_t const num_buckets,
+  std::string_view const key,
+  KeyOf const &key_of) noexcept
+{
+  uint64_t const mask = num_buckets - 1;
+  // there is always at least one empty bucket, so this terminates
+  for (uint64_t pos = fnv1a(key) & mask;; pos = (pos + 1) & mask)
+  {
+    uint32_t const bucket = buckets[pos];
+    if (bucket == 0 || key_of(bucket - 1) == key)
+      return bucket;
+  }
+}
+
+// Archive layout, in native byte order: the magic padded to the alignment, the
+// rasters each padded to the alignment, then the index: the records in the
+// order added, the hash buckets, the names packed together and the footer.
+struct archive_record
+{
+  uint64_t raster_offset;
+  uint32_t name_offset;
+  uint32_t name_length;
+  uint16_t width;
+  uint16_t height;
+  uint8_t maxval;
+  uint8_t padding[3];
+};
+
+struct archive_footer
+{
+  uint64_t index_offset;
+  uint32_t num_images;
+  uint32_t num_buckets;
+  uint32_t names_size;
+  uint32_t version;
+  char magic[8];
+};
+
+static_assert(sizeof(archive_record) == 24);
+static_assert(sizeof(archive_footer) == 32);
+
+static constexpr char s_archive_magic[8] { 'P', 'G', 'M', '8', 'A', 'R', 'C', '\0' };
+static constexpr uint32_t s_archive_version = 1;
+
+// Writes zeros up to the next multiple of the archive alignment, returning the new offset.
+static
+uint64_t pad_to_alignment(std::ofstream &file, uint64_t const offset)
+{
+  static constexpr size_t alignment = pgm8::archive_writer::alignment;
+  static constexpr std::array<char, alignment> s_zeros{};
+
+  uint64_t const padding = (alignment - (offset % alignment)) % alignment;
+  file.write(s_zeros.data(), static_cast<std::streamsize>(padding));
+  return offset + padding;
+}
+
+pgm8::archive_writer::archive_writer(std::string const &path)
+  : m_file(path, std::ios::binary | std::ios::trunc)
+{
+  if (!m_file.is_open())
+    throw std::runtime_error("failed to open archive file");
+
+  m_file.write(s_archive_magic, sizeof(s_archive_magic));
+  m_offset = pad_to_alignment(m_file, sizeof(s_archive_magic));
+}
+
+pgm8::archive_writer::~archive_writer()
+{
+  if (!m_closed)
+  {
+    try
+    {
+      write_index();
+    }
+    catch (...)
+    {
+      // nothing sensible to do here, call close() to see errors
+    }
+  }
+}
+
+size_t pgm8::archive_writer::size() const noexcept
+{
+  return m_records.size();
+}
+
+void pgm8::archive_writer::add(
+  std::string_view const name,
+  image_properties props,
+  uint8_t const *const pixels)
+{
+  if (m_closed)
+    throw std::runtime_error("archive already closed");
+  props.validate();
+  if (!m_names.emplace(name).second) {
+    std::stringstream err{};
+    err << "duplicate archive name \"" << name << '"';
+    throw std::runtime_error(err.str());
+  }
+
+  props.set_format(format::RAW);
+  m_records.push_back({ std::string(name), props, m_offset });
+
+  size_t const num_pixels = props.num_pixels();
+  m_file.write(reinterpret_cast<char const *>(pixels), static_cast<std::streamsize>(num_pixels));
+  m_offset = pad_to_alignment(m_file, m_offset + num_pixels);
+
+  if (m_file.fail())
+    throw std::runtime_error("failed to write archive");
+}
+
+void pgm8::archive_writer::close()
+{
+  if (m_closed)
+    return;
+
+  write_index();
+  m_file.close();
+  if (m_file.fail())
+    throw std::runtime_error("failed to write archive");
+}
+
+void pgm8::archive_writer::write_index()
+{
+  // even if this fails, so the destructor won't retry
+  m_closed = true;
+
+  archive_footer footer{};
+  footer.index_offset = m_offset;
+  footer.num_images = static_cast<uint32_t>(m_records.size());
+  footer.num_buckets = static_cast<uint32_t>(std::bit_ceil((m_records.size() * 2) + 1));
+  footer.version = s_archive_version;
+  std::memcpy(footer.magic, s_archive_magic, sizeof(s_archive_magic));
+
+  std::vector<archive_record> records(m_records.size());
+  std::vector<uint32_t> buckets(footer.num_buckets, 0);
+  std::string names{};
+
+  for (size_t i = 0; i < m_records.size(); ++i)
+  {
+    auto const &rec = m_records[i];
+    records[i] = {
+      .raster_offset = rec.raster_offset,
+      .name_offset = static_cast<uint32_t>(names.size()),
+      .name_length = static_cast<uint32_t>(rec.name.size()),
+      .width = rec.props.get_width(),
+      .height = rec.props.get_height(),
+      .maxval = rec.props.get_maxval(),
+      .padding = {},
+    };
+    names += rec.name;
+    insert_bucket(buckets, rec.name, i);
+  }
+  footer.names_size = static_cast<uint32_t>(names.size());
+
+  m_file.write(reinterpret_cast<char const *>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(archive_record)));
+  m_file.write(reinterpret_cast<char const *>(buckets.data()), static_cast<std::streamsize>(buckets.size() * sizeof(uint32_t)));
+  m_file.write(names.data(), static_cast<std::streamsize>(names.size()));
+  m_file.write(reinterpret_cast<char const *>(&footer), sizeof(footer));
+}
+
+// Source bytes a pyramid band covers, at least. Small enough for the band and
+// the levels computed from it to stay in cache.
+static constexpr size_t s_pyramid_band_size = 256 * 1024;
+
+// Rounded averages of vertically adjacent box sums, `bottom` null if there is
+// no row below.
+static
+void average_box_sums(
+  uint16_t const *const top,
+  uint16_t const *const bottom,
+  size_t const count,
+  uint8_t *const dst) noexcept
+{
+  // as in undo_row_prediction
+  static constexpr size_t lanes = 32;
+
+  size_t x = 0;
+  if (bottom != nullptr) {
+    for (; x + lanes <= count; x += lanes) {
+      uint8_t group[lanes];
+      for (size_t j = 0; j < lanes; ++j)
+        group[j] = static_cast<uint8_t>((top[x + j] + bottom[x + j] + 2) >> 2);
+      std::memcpy(dst + x, group, lanes);
+    }
+    for (; x < count; ++x)
+      dst[x] = static_cast<uint8_t>((top[x] + bottom[x] + 2) >> 2);
+  } else {
+    for (; x < count; ++x)
+      dst[x] = static_cast<uint8_t>((top[x] + 1) >> 1);
+  }
+}
+
+// Computes rows [first_row, end_row) of the next pyramid level from `src`, each
+// pixel the rounded average of a 2x2 box, narrower or shorter at odd edges.
+// `scratch` holds 2 * ((src_width + 1) / 2) values.
+static
+void halve_rows(
+  uint8_t const *const src,
+  size_t const src_width,
+  size_t const src_height,
+  uint8_t *const dst,
+  size_t const first_row,
+  size_t const end_row,
+  uint16_t *const scratch) noexcept
+{
+  size_t const dst_width = (src_width + 1) / 2;
+  size_t const num_full_boxes = src_width / 2;
+  uint16_t *const top_sums = scratch;
+  uint16_t *const bottom_sums = scratch + dst_width;
+
+  for (size_t y = first_row; y < end_row; ++y)
+  {
+    uint8_t const *const top = src + (2 * y * src_width);
+    uint8_t const *const bottom = (2 * y) + 1 < src_height ? top + src_width : nullptr;
+    uint8_t *const out = dst + (y * dst_width);
+
+    sum_row_boxes<2>(top, 2, num_full_boxes, top_sums);
+    if (bottom != nullptr)
+      sum_row_boxes<2>(bottom, 2, num_full_boxes, bottom_sums);
+    average_box_sums(top_sums, bottom != nullptr ? bottom_sums : nullptr, num_full_boxes, out);
+
+    if (num_full_boxes < dst_width) {
+      unsigned const sum = top[src_width - 1] + (bottom != nullptr ? bottom[src_width - 1] : 0u);
+      unsigned const count = bottom != nullptr ? 2 : 1;
+      out[num_full_boxes] = static_cast<uint8_t>((sum + (count / 2)) / count);
+    }
+  }
+}
+
+void pgm8::write_pyramid(
+  std::string const &base_path,
+  image_properties const props,
+  uint8_t const *const pixels,
+  unsigned const levels,
+  pyramid_options const &options)
+{
+  validate_for_write(props);
+  if (levels == 0 || levels > max_pyramid_levels) {
+    std::stringstream err{};
+    err << "levels must be 1-" << max_pyramid_levels;
+    throw std::runtime_error(err.str());
+  }
+
+  std::vector<image_properties> level_props(levels, props);
+  std::vector<std::unique_ptr<uint8_t []>> level_buffers(levels);
+  std::vector<uint8_t const *> level_pixels(levels, pixels);
+  for (size_t l = 1; l < levels; ++l) {
+    level_props[l].set_width(static_cast<uint16_t>((level_props[l - 1].get_width() + 1) / 2));
+    level_props[l].set_height(static_cast<uint16_t>((level_props[l - 1].get_height() + 1) / 2));
+    level_buffers[l].reset(new uint8_t[level_props[l].num_pixels()]);
+    level_pixels[l] = level_buffers[l].get();
+  }
+
+  // Bands are whole rows at every level, so each band computes all of its
+  // levels while its rows are still in cache, independently of other bands.
+  size_t const width = props.get_width(), height = props.get_height();
+  size_t const band_alignment = size_t{1} << (levels - 1);
+  size_t const band_rows = band_alignment * std::max<size_t>(1, s_pyramid_band_size / (width * band_alignment));
+  size_t const num_bands = (height + band_rows - 1) / band_rows;
+  unsigned const num_threads = resolve_num_threads(options.num_threads);
+
+  parallel_for(levels > 1 ? num_bands : 0, num_threads, [&](size_t const band)
+  {
+    std::unique_ptr<uint16_t []> scratch(new uint16_t[2 * level_props[1].get_width()]);
+
+    for (size_t l = 1; l < levels; ++l)
+    {
+      size_t const first_row = (band * band_rows) >> l;
+      size_t const end_row = std::min<size_t>(((band + 1) * band_rows) >> l, level_props[l].get_height());
+      halve_rows(
+        level_pixels[l - 1], level_props[l - 1].get_width(), level_props[l - 1].get_height(),
+        level_buffers[l].get(), first_row, end_row, scratch.get());
+    }
+  });
+
+  if (options.archive)
+  {
+    archive_writer writer(base_path + ".pgma");
+    for (size_t l = 0; l < levels; ++l)
+      writer.add(std::to_string(l), level_props[l], level_pixels[l]);
+    writer.close();
+  }
+  else
+  {
+    parallel_for(levels, num_threads, [&](size_t const l)
+    {
+      write(base_path + "." + std::to_string(l) + ".pgm", level_props[l], {}, level_pixels[l]);
+    });
+  }
+}
+
+#if PGM8_POSIX
+
+static
+int to_madvise_advice(pgm8::access_hint const hint) noexcept
+{
+  switch (hint)
+  {
+    case pgm8::access_hint::SEQUENTIAL: return MADV_SEQUENTIAL;
+    case pgm8::access_hint::RANDOM:     return MADV_RANDOM;
+    case pgm8::access_hint::WILL_NEED:  return MADV_WILLNEED;
+    case pgm8::access_hint::NORMAL:
+    default:                            return MADV_NORMAL;
+  }
+}
+
+// Maps the whole file at `path` read-only, storing its size in `size`.
+static
+void *map_file(char const *const path, size_t &size)
+{
+  int const fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    throw make_errno_error("failed to open file");
+
+  struct stat info{};
+  if (::fstat(fd, &info) == -1) {
+    auto const err = make_errno_error("failed to stat file");
+    ::close(fd);
+    throw err;
+  }
+  if (info.st_size <= 0) {
+    ::close(fd);
+    throw std::runtime_error("file is empty");
+  }
+
+  size = static_cast<size_t>(info.st_size);
+  void *const mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping keeps its own reference to the file
+  ::close(fd);
+  if (mapping == MAP_FAILED)
+    throw make_errno_error("failed to map file");
+
+  return mapping;
+}
+
+pgm8::mapped_image::mapped_image(
+  std::string const &path,
+  access_hint const hint)
+{
+  size_t size = 0;
+  void *const mapping = map_file(path.c_str(), size);
+
+  m_mapping = mapping;
+  m_mapping_size = size;
+
+  try
+  {
+    char const *const begin = static_cast<char const *>(mapping);
+    char const *const end = begin + size;
+
+    size_t num_consumed = 0;
+    m_props = parse_properties(begin, end, num_consumed);
+    num_consumed += parse_comments(begin + num_consumed, end);
+
+    if (m_props.get_format() != format::RAW)
+      throw std::runtime_error("only RAW images can be mapped");
+    if (size - num_consumed < m_props.num_pixels())
+      throw std::runtime_error("file too small for raster");
+
+    m_raster_offset = num_consumed;
+    advise(hint);
+  }
+  catch (...)
+  {
+    ::munmap(m_mapping, m_mapping_size);
+    throw;
+  }
+}
+
+pgm8::mapped_image::mapped_image(mapped_image &&other) noexcept
+  : m_mapping(other.m_mapping)
+  , m_mapping_size(other.m_mapping_size)
+  , m_raster_offset(other.m_raster_offset)
+  , m_props(other.m_props)
+{
+  other.m_mapping = nullptr;
+  other.m_mapping_size = 0;
+}
+
+pgm8::mapped_image &pgm8::mapped_image::operator=(mapped_image &&other) noexcept
+{
+  if (this != &other)
+  {
+    if (m_mapping != nullptr)
+      ::munmap(m_mapping, m_mapping_size);
+
+    m_mapping = other.m_mapping;
+    m_mapping_size = other.m_mapping_size;
+    m_raster_offset = other.m_raster_offset;
+    m_props = other.m_props;
+
+    other.m_mapping = nullptr;
+    other.m_mapping_size = 0;
+  }
+  return *this;
+}
+
+pgm8::mapped_image::~mapped_image()
+{
+  if (m_mapping != nullptr)
+    ::munmap(m_mapping, m_mapping_size);
+}
+
+pgm8::image_properties pgm8::mapped_image::get_properties() const noexcept
+{
+  return m_props;
+}
+
+std::span<uint8_t const> pgm8::mapped_image::get_pixels() const noexcept
+{
+  if (m_mapping == nullptr)
+    return {};
+  return { static_cast<uint8_t const *>(m_mapping) + m_raster_offset, m_props.num_pixels() };
+}
+
+void pgm8::mapped_image::advise(access_hint const hint) const
+{
+  if (m_mapping == nullptr)
+    return;
+  if (::madvise(m_mapping, m_mapping_size, to_madvise_advice(hint)) == -1)
+    throw make_errno_error("madvise failed");
+}
+
+// Index file layout, in native byte order: the header, the records, the hash
+// buckets, then the paths packed together. The first `num_images` records are
+// the images sorted by path, the rest are files which failed to probe (format
+// NIL), kept so they aren't probed again until they change.
+struct index_file_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t num_records;
+  uint32_t num_images;
+  uint32_t num_buckets;
+  uint32_t strings_size;
+  uint32_t reserved;
+};
+
+struct index_record
+{
+  int64_t mtime_ns;
+  uint64_t file_size;
+  uint64_t raster_offset;
+  uint32_t path_offset;
+  uint32_t path_length;
+  uint16_t width;
+  uint16_t height;
+  uint8_t maxval;
+  uint8_t format;
+  uint8_t padding[2];
+};
+
+static_assert(sizeof(index_file_header) == 32);
+static_assert(sizeof(index_record) == 40);
+
+static constexpr char s_index_magic[8] { 'P', 'G', 'M', '8', 'I', 'D', 'X', '\0' };
+static constexpr uint32_t s_index_version = 1;
+
+struct index_view
+{
+  index_file_header const *header;
+  index_record const *records;
+  uint32_t const *buckets;
+  char const *strings;
+};
+
+static
+index_view view_index(void const *const mapping) noexcept
+{
+  auto const *const base = static_cast<char const *>(mapping);
+  auto const *const header = reinterpret_cast<index_file_header const *>(base);
+  auto const *const records = reinterpret_cast<index_record const *>(header + 1);
+  auto const *const buckets = reinterpret_cast<uint32_t const *>(records + header->num_records);
+  return { header, records, buckets, reinterpret_cast<char const *>(buckets + header->num_buckets) };
+}
+
+static
+pgm8::image_properties to_properties(index_record const &rec)
+{
+  pgm8::image_properties props;
+  props.set_width(rec.width);
+  props.set_height(rec.height);
+  props.set_maxval(rec.maxval);
+  props.set_format(static_cast<pgm8::format>(rec.format));
+  return props;
+}
+
+// Throws if the mapped index is truncated or inconsistent.
+static
+void validate_index(void const *const mapping, size_t const size)
+{
+  if (size < sizeof(index_file_header))
+    throw std::runtime_error("index file truncated");
+
+  auto const &header = *static_cast<index_file_header const *>(mapping);
+  if (std::memcmp(header.magic, s_index_magic, sizeof(s_index_magic)) != 0)
+    throw std::runtime_error("not an index file");
+  if (header.version != s_index_version)
+    throw std::runtime_error("unsupported index version");
+  if (header.num_images > header.num_records)
+    throw std::runtime_error("bad index image count");
+  if (!std::has_single_bit(header.num_buckets) || header.num_buckets <= header.num_records)
+    throw std::runtime_error("bad index bucket count");
+
+  size_t const expected_size = sizeof(index_file_header)
+    + (size_t{header.num_records} * sizeof(index_record))
+    + (size_t{header.num_buckets} * sizeof(uint32_t))
+    + header.strings_size;
+  if (size != expected_size)
+    throw std::runtime_error("index file size mismatch");
+
+  auto const view = view_index(mapping);
+  for (uint32_t i = 0; i < header.num_records; ++i) {
+    auto const &rec = view.records[i];
+    if (size_t{rec.path_offset} + rec.path_length > header.strings_size)
+      throw std::runtime_error("index path out of range");
+    if (i < header.num_images)
+      static_cast<void>(to_properties(rec));
+    else if (rec.format != static_cast<uint8_t>(pgm8::format::NIL))
+      throw std::runtime_error("bad index record format");
+  }
+  size_t num_empty = 0;
+  for (uint32_t i = 0; i < header.num_buckets; ++i) {
+    if (view.buckets[i] > header.num_records)
+      throw std::runtime_error("index bucket out of range");
+    num_empty += view.buckets[i] == 0;
+  }
+  // lookups probe until an empty bucket
+  if (num_empty == 0)
+    throw std::runtime_error("index has no empty bucket");
+}
+
+// Returns the record for `path`, or nullptr if there is none.
+static
+index_record const *find_record(void const *const mapping, std::string_view const path) noexcept
+{
+  if (mapping == nullptr)
+    return nullptr;
+
+  auto const view = view_index(mapping);
+  uint32_t const bucket = find_bucket(view.buckets, view.header->num_buckets, path, [&view](size_t const idx) {
+    auto const &rec = view.records[idx];
+    return std::string_view(view.strings + rec.path_offset, rec.path_length);
+  });
+  return bucket == 0 ? nullptr : &view.records[bucket - 1];
+}
+
+static
+int64_t mtime_ns(struct stat const &info) noexcept
+{
+#ifdef __APPLE__
+  timespec const &mtime = info.st_mtimespec;
+#else
+  timespec const &mtime = info.st_mtim;
+#endif
+  return (int64_t{mtime.tv_sec} * 1'000'000'000) + mtime.tv_nsec;
+}
+
+pgm8::corpus_index::corpus_index(std::string index_path)
+  : m_index_path(std::move(index_path))
+{
+  struct stat info{};
+  if (::stat(m_index_path.c_str(), &info) == -1 && errno == ENOENT)
+    return;
+
+  m_mapping = map_file(m_index_path.c_str(), m_mapping_size);
+  try
+  {
+    validate_index(m_mapping, m_mapping_size);
+  }
+  catch (...)
+  {
+    ::munmap(m_mapping, m_mapping_size);
+    throw;
+  }
+}
+
+pgm8::corpus_index::corpus_index(corpus_index &&other) noexcept
+  : m_index_path(std::move(other.m_index_path))
+  , m_mapping(other.m_mapping)
+  , m_mapping_size(other.m_mapping_size)
+{
+  other.m_mapping = nullptr;
+  other.m_mapping_size = 0;
+}
+
+pgm8::corpus_index &pgm8::corpus_index::operator=(corpus_index &&other) noexcept
+{
+  if (this != &other)
+  {
+    if (m_mapping != nullptr)
+      ::munmap(m_mapping, m_mapping_size);
+
+    m_index_path = std::move(other.m_index_path);
+    m_mapping = other.m_mapping;
+    m_mapping_size = other.m_mapping_size;
+
+    other.m_mapping = nullptr;
+    other.m_mapping_size = 0;
+  }
+  return *this;
+}
+
+pgm8::corpus_index::~corpus_index()
+{
+  if (m_mapping != nullptr)
+    ::munmap(m_mapping, m_mapping_size);
+}
+
+size_t pgm8::corpus_index::size() const noexcept
+{
+  if (m_mapping == nullptr)
+    return 0;
+  return static_cast<index_file_header const *>(m_mapping)->num_images;
+}
+
+pgm8::corpus_index::entry pgm8::corpus_index::get_entry(size_t const idx) const
+{
+  if (idx >= size())
+    throw std::out_of_range("corpus_index entry out of range");
+
+  auto const view = view_index(m_mapping);
+  auto const &rec = view.records[idx];
+  return {
+    .path = { view.strings + rec.path_offset, rec.path_length },
+    .mtime_ns = rec.mtime_ns,
+    .file_size = rec.file_size,
+    .props = to_properties(rec),
+    .raster_offset = rec.raster_offset,
+  };
+}
+
+std::optional<pgm8::corpus_index::entry> pgm8::corpus_index::find(std::string_view const path) const
+{
+  index_record const *const rec = find_record(m_mapping, path);
+  if (rec == nullptr)
+    return std::nullopt;
+
+  auto const idx = static_cast<size_t>(rec - view_index(m_mapping).records);
+  if (idx >= size())
+    return std::nullopt;
+  return get_entry(idx);
+}
+
+size_t pgm8::corpus_index::update(std::string const &root, unsigned const num_threads)
+{
+  namespace fs = std::filesystem;
+
+  struct scanned_file
+  {
+    std::string path;
+    int64_t mtime_ns;
+    uint64_t file_size;
+    image_properties props;
+    size_t raster_offset;
+    bool failed;
+  };
+
+  std::vector<scanned_file> files{};
+  std::vector<size_t> to_probe{};
+  std::vector<std::string> probe_paths{};
+
+  for (auto const &dirent : fs::recursive_directory_iterator(root, fs::directory_options::skip_permission_denied))
+  {
+    if (!dirent.is_regular_file() || dirent.path().extension() != ".pgm")
+      continue;
+
+    struct stat info{};
+    if (::stat(dirent.path().c_str(), &info) == -1)
+      continue; // removed during the scan
+
+    scanned_file file{
+      .path = dirent.path().lexically_relative(root).generic_string(),
+      .mtime_ns = mtime_ns(info),
+      .file_size = static_cast<uint64_t>(info.st_size),
+      .props = {},
+      .raster_offset = 0,
+      .failed = false,
+    };
+
+    index_record const *const existing = find_record(m_mapping, file.path);
+    if (existing && existing->mtime_ns == file.mtime_ns && existing->file_size == file.file_size) {
+      file.failed = existing->format == static_cast<uint8_t>(format::NIL);
+      if (!file.failed)
+        file.props = to_properties(*existing);
+      file.raster_offset = existing->raster_offset;
+    } else {
+      to_probe.push_back(files.size());
+      probe_paths.push_back(dirent.path().string());
+    }
+    files.push_back(std::move(file));
+  }
+
+  auto const results = probe_many(probe_paths, num_threads);
+  for (size_t i = 0; i < results.size(); ++i) {
+    auto &file = files[to_probe[i]];
+    if (results[i].error) {
+      file.failed = true; // recorded with NIL properties
+    } else {
+      file.props = results[i].props;
+      file.raster_offset = results[i].raster_offset;
+    }
+  }
+
+  std::sort(files.begin(), files.end(), [](scanned_file const &lhs, scanned_file const &rhs) {
+    if (lhs.failed != rhs.failed)
+      return rhs.failed;
+    return lhs.path < rhs.path;
+  });
+
+  index_file_header header{};
+  std::memcpy(header.magic, s_index_magic, sizeof(s_index_magic));
+  header.version = s_index_version;
+  header.num_records = static_cast<uint32_t>(files.size());
+  header.num_images = static_cast<uint32_t>(std::count_if(files.begin(), files.end(),
+    [](scanned_file const &file) { return !file.failed; }));
+  header.num_buckets = static_cast<uint32_t>(std::bit_ceil((files.size() * 2) + 1));
+
+  std::vector<index_record> records(files.size());
+  std::vector<uint32_t> buckets(header.num_buckets, 0);
+  std::string strings{};
+
+  for (size_t i = 0; i < files.size(); ++i)
+  {
+    auto const &file = files[i];
+    records[i] = {
+      .mtime_ns = file.mtime_ns,
+      .file_size = file.file_size,
+      .raster_offset = file.raster_offset,
+      .path_offset = static_cast<uint32_t>(strings.size()),
+      .path_length = static_cast<uint32_t>(file.path.size()),
+      .width = file.props.get_width(),
+      .height = file.props.get_height(),
+      .maxval = file.props.get_maxval(),
+      .format = static_cast<uint8_t>(file.props.get_format()),
+      .padding = {},
+    };
+    strings += file.path;
+
+    insert_bucket(buckets, file.path, i);
+  }
+  header.strings_size = static_cast<uint32_t>(strings.size());
+
+  // written next to the old index and renamed over it, so readers never see a partial file
+  std::string const tmp_path = m_index_path + ".tmp";
+  {
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open())
+      throw std::runtime_error("failed to open index file for writing");
+
+    out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    out.write(reinterpret_cast<char const *>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(index_record)));
+    out.write(reinterpret_cast<char const *>(buckets.data()), static_cast<std::streamsize>(buckets.size() * sizeof(uint32_t)));
+    out.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+    out.close();
+    if (out.fail())
+      throw std::runtime_error("failed to write index file");
+  }
+  if (std::rename(tmp_path.c_str(), m_index_path.c_str()) != 0)
+    throw make_errno_error("failed to replace index file");
+
+  size_t new_size = 0;
+  void *const new_mapping = map_file(m_index_path.c_str(), new_size);
+  if (m_mapping != nullptr)
+    ::munmap(m_mapping, m_mapping_size);
+  m_mapping = new_mapping;
+  m_mapping_size = new_size;
+
+  return probe_paths.size();
+}
+
+struct archive_view
+{
+  archive_footer footer;
+  archive_record const *records;
+  uint32_t const *buckets;
+  char const *names;
+};
+
+static
+archive_view view_archive(void const *const mapping, size_t const size) noexcept
+{
+  auto const *const base = static_cast<char const *>(mapping);
+  // copied out, the names before it leave the footer unaligned
+  archive_footer footer;
+  std::memcpy(&footer, base + size - sizeof(archive_footer), sizeof(footer));
+  auto const *const records = reinterpret_cast<archive_record const *>(base + footer.index_offset);
+  auto const *const buckets = reinterpret_cast<uint32_t const *>(records + footer.num_images);
+  return { footer, records, buckets, reinterpret_cast<char const *>(buckets + footer.num_buckets) };
+}
+
+static
+pgm8::image_properties to_properties(archive_record const &rec)
+{
+  pgm8::image_properties props;
+  props.set_width(rec.width);
+  props.set_height(rec.height);
+  props.set_maxval(rec.maxval);
+  props.set_format(pgm8::format::RAW);
+  return props;
+}
+
+// Throws if the mapped archive is truncated or inconsistent.
+static
+void validate_archive(void const *const mapping, size_t const size)
+{
+  if (size < sizeof(s_archive_magic) + sizeof(archive_footer)
+    || std::memcmp(mapping, s_archive_magic, sizeof(s_archive_magic)) != 0)
+    throw std::runtime_error("not an archive");
+
+  archive_footer footer{};
+  std::memcpy(&footer, static_cast<char const *>(mapping) + size - sizeof(footer), sizeof(footer));
+  if (std::memcmp(footer.magic, s_archive_magic, sizeof(s_archive_magic)) != 0)
+    throw std::runtime_error("archive footer missing, was it closed?");
+  if (footer.version != s_archive_version)
+    throw std::runtime_error("unsupported archive version");
+  if (!std::has_single_bit(footer.num_buckets) || footer.num_buckets <= footer.num_images)
+    throw std::runtime_error("bad archive bucket count");
+  if (footer.index_offset % pgm8::archive_writer::alignment != 0)
+    throw std::runtime_error("misaligned archive index");
+
+  size_t const index_size = (size_t{footer.num_images} * sizeof(archive_record))
+    + (size_t{footer.num_buckets} * sizeof(uint32_t))
+    + footer.names_size
+    + sizeof(archive_footer);
+  if (footer.index_offset > size || size - footer.index_offset != index_size)
+    throw std::runtime_error("archive size mismatch");
+
+  auto const view = view_archive(mapping, size);
+  for (uint32_t i = 0; i < footer.num_images; ++i) {
+    auto const &rec = view.records[i];
+    if (size_t{rec.name_offset} + rec.name_length > footer.names_size)
+      throw std::runtime_error("archive name out of range");
+    // no sum, a raster_offset near UINT64_MAX would wrap it
+    if (rec.raster_offset % pgm8::archive_writer::alignment != 0
+      || rec.raster_offset > footer.index_offset
+      || to_properties(rec).num_pixels() > footer.index_offset - rec.raster_offset)
+      throw std::runtime_error("archive raster out of range");
+  }
+  size_t num_empty = 0;
+  for (uint32_t i = 0; i < footer.num_buckets; ++i) {
+    if (view.buckets[i] > footer.num_images)
+      throw std::runtime_error("archive bucket out of range");
+    num_empty += view.buckets[i] == 0;
+  }
+  // lookups probe until an empty bucket
+  if (num_empty == 0)
+    throw std::runtime_error("archive has no empty bucket");
+}
+
+pgm8::archive_reader::archive_reader(
+  std::string const &path,
+  access_hint const hint)
+{
+  m_mapping = map_file(path.c_str(), m_mapping_size);
+  try
+  {
+    validate_archive(m_mapping, m_mapping_size);
+    advise(hint);
+  }
+  catch (...)
+  {
+    ::munmap(m_mapping, m_mapping_size);
+    throw;
+  }
+}
+
+pgm8::archive_reader::archive_reader(archive_reader &&other) noexcept
+  : m_mapping(other.m_mapping)
+  , m_mapping_size(other.m_mapping_size)
+{
+  other.m_mapping = nullptr;
+  other.m_mapping_size = 0;
+}
+
+pgm8::archive_reader &pgm8::archive_reader::operator=(archive_reader &&other) noexcept
+{
+  if (this != &other)
+  {
+    if (m_mapping != nullptr)
+      ::munmap(m_mapping, m_mapping_size);
+
+    m_mapping = other.m_mapping;
+    m_mapping_size = other.m_mapping_size;
+
+    other.m_mapping = nullptr;
+    other.m_mapping_size = 0;
+  }
+  return *this;
+}
+
+pgm8::archive_reader::~archive_reader()
+{
+  if (m_mapping != nullptr)
+    ::munmap(m_mapping, m_mapping_size);
+}
+
+size_t pgm8::archive_reader::size() const noexcept
+{
+  if (m_mapping == nullptr)
+    return 0;
+  return view_archive(m_mapping, m_mapping_size).footer.num_images;
+}
+
+pgm8::archive_entry pgm8::archive_reader::get_entry(size_t const idx) const
+{
+  if (idx >= size())
+    throw std::out_of_range("archive entry out of range");
+
+  auto const view = view_archive(m_mapping, m_mapping_size);
+  auto const &rec = view.records[idx];
+  auto const props = to_properties(rec);
+  return {
+    .name = { view.names + rec.name_offset, rec.name_length },
+    .props = props,
+    .pixels = { static_cast<uint8_t const *>(m_mapping) + rec.raster_offset, props.num_pixels() },
+  };
+}
+
+std::optional<pgm8::archive_entry> pgm8::archive_reader::find(std::string_view const name) const
+{
+  if (m_mapping == nullptr)
+    return std::nullopt;
+
+  auto const view = view_archive(m_mapping, m_mapping_size);
+  uint32_t const bucket = find_bucket(view.buckets, view.footer.num_buckets, name, [&view](size_t const idx) {
+    auto const &rec = view.records[idx];
+    return std::string_view(view.names + rec.name_offset, rec.name_length);
+  });
+  if (bucket == 0)
+    return std::nullopt;
+  return get_entry(bucket - 1);
+}
+
+void pgm8::archive_reader::advise(access_hint const hint) const
+{
+  if (m_mapping == nullptr)
+    return;
+  if (::madvise(m_mapping, m_mapping_size, to_madvise_advice(hint)) == -1)
+    throw make_errno_error("madvise failed");
+}
+
+#endif // PGM8_POSIX
@@ -1,9 +1,26 @@
 #ifndef NLUKA_PGM8_HPP
 #define NLUKA_PGM8_HPP
 
+#include <cstdint>
 #include <fstream>
+#include <memory>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <optional>
+#include <unordered_set>
+#include <span>
+#include <functional>
+#include <exception>
+#include <array>
+#include <atomic>
+#include <mutex>
+
+#if defined(__unix__) || defined(__APPLE__)
+# define PGM8_POSIX 1
+#else
+# define PGM8_POSIX 0
+#endif
 
 // Module for reading and writing 8-bit PGM images.
 namespace pgm8 {
@@ -15,6 +32,8 @@ enum class format : uint8_t
   PLAIN = 2,
   // Pixels stored in binary raster.
   RAW = 5,
+  // Not part of netpbm. Pixels stored as row deltas, run-length encoded; see README.
+  COMPRESSED = 8,
 };
 
 struct image_properties
@@ -45,8 +64,128 @@ private:
     m_fmt_set = false;
 };
 
+namespace internal {
+
+// Incremental parser for PLAIN pixel data, fed with arbitrarily sized chunks
+// of text. Tokens may be split across chunk boundaries.
+struct plain_decoder
+{
+  uint8_t *out;
+  size_t num_pixels;
+  // Index of out[0] within the whole image, used in error messages.
+  size_t first_index = 0;
+  size_t num_decoded = 0;
+  unsigned value = 0;
+  unsigned num_digits = 0;
+
+  // Parses as much of [begin, end) as possible. Returns the number of chars
+  // consumed; stops right after the last digit of the final pixel, so
+  // whitespace following the raster is left unconsumed.
+  size_t feed(char const *begin, char const *end);
+
+  // To be called once the input is exhausted, throws if pixels are missing.
+  void finish();
+
+  [[nodiscard]] bool done() const noexcept { return num_decoded == num_pixels; }
+};
+
+// Incremental decoder for COMPRESSED pixel data, fed with arbitrarily sized
+// chunks. Runs may be split across chunk boundaries, never across rows.
+struct compressed_decoder
+{
+  uint8_t *out;
+  size_t width;
+  size_t num_rows;
+  // The previously decoded row, zeros before the first. Updated as rows are decoded.
+  uint8_t *prev_row;
+  // Index of out's first row within the whole image, used in error messages.
+  size_t first_row = 0;
+  size_t num_rows_decoded = 0;
+  size_t row_pos = 0;
+  // Bytes left to copy in a literal run, or copies left to make of a repeated
+  // byte which hasn't been read yet. 0 between runs.
+  size_t run_len = 0;
+  bool run_is_repeat = false;
+
+  // Decodes as much of [begin, end) as possible. Returns the number of chars
+  // consumed; stops right after the last byte of the final row.
+  size_t feed(char const *begin, char const *end);
+
+  // To be called once the input is exhausted, throws if rows are missing.
+  void finish() const;
+
+  [[nodiscard]] bool done() const noexcept { return num_rows_decoded == num_rows; }
+};
+
+} // namespace internal
+
 [[nodiscard]] image_properties read_properties(std::ifstream &file);
 
+// A whole header (properties and comments) parsed out of one fixed-size buffer
+// without allocating. Comments before maxval, as allowed by the netpbm spec,
+// and comment lines following the header are both included, in file order.
+class header
+{
+public:
+  // Most bytes a header may span, up to the start of the raster.
+  static constexpr size_t capacity = 4096;
+
+  [[nodiscard]] image_properties get_properties() const noexcept;
+
+  // Offset of the raster from the start of the header.
+  [[nodiscard]] size_t get_raster_offset() const noexcept;
+
+  [[nodiscard]] size_t num_comments() const noexcept;
+  // Comment content without the #, valid for as long as this header.
+  [[nodiscard]] std::string_view get_comment(size_t idx) const noexcept;
+
+private:
+  friend header read_header(std::ifstream &);
+  friend header read_header(std::span<uint8_t const>);
+
+  void parse(size_t num_valid, bool more_follows);
+
+  struct comment_record
+  {
+    uint16_t offset, length;
+  };
+
+  std::array<char, capacity> m_buffer;
+  // every comment takes at least 2 bytes ("#\n")
+  std::array<comment_record, capacity / 2> m_comments;
+  size_t m_num_comments = 0;
+  size_t m_raster_offset = 0;
+  image_properties m_props{};
+};
+
+struct probe_result
+{
+  image_properties props;
+  // Offset of the raster from the start of the file.
+  size_t raster_offset;
+  // Only set by probe_many, instead of the fields above, if the file couldn't be probed.
+  std::exception_ptr error;
+};
+
+// Reads just the start of the file at `path` to get its properties and raster
+// offset, without constructing a stream. On POSIX a single pread of 512 bytes
+// covers typical headers, longer ones are read again up to header::capacity.
+[[nodiscard]] probe_result probe(std::string const &path);
+
+// Probes many files on `num_threads` threads (0 means one per hardware thread).
+// Failures are reported per file through `probe_result::error`.
+[[nodiscard]] std::vector<probe_result> probe_many(
+  std::vector<std::string> const &paths,
+  unsigned num_threads = 0
+);
+
+// Reads the header and comments, leaving `file` positioned at the raster.
+// Throws if they span more than header::capacity bytes.
+[[nodiscard]] header read_header(std::ifstream &file);
+
+// Parses the header and comments at the start of `buffer`.
+[[nodiscard]] header read_header(std::span<uint8_t const> buffer);
+
 [[nodiscard]] std::vector<std::string> read_comments(std::ifstream &file);
 
 size_t skip_comments(std::ifstream &file);
@@ -64,6 +203,703 @@ void write(
   uint8_t const *pixels
 );
 
+struct read_options
+{
+  // Threads used to decode PLAIN pixels, 0 means one per hardware thread.
+  unsigned num_threads = 1;
+  // Approximate amount of PLAIN text each thread decodes at a time.
+  size_t chunk_size = 1024 * 1024;
+  // Maps samples from [0, maxval] to [0, 255], as (v * 255 + maxval / 2) / maxval,
+  // as they're decoded. Samples above maxval become 255. `props` is unaffected.
+  bool rescale = false;
+  // Throws if a sample is above maxval. Checked block by block as pixels are
+  // decoded, before any rescaling.
+  bool validate = false;
+};
+
+// Like the overload above, but decodes PLAIN pixels on `options.num_threads`
+// threads. The text is split into chunks at whitespace, tokens are counted per
+// chunk to find where each chunk's pixels go, then the chunks are decoded
+// concurrently. At most `num_threads * chunk_size` bytes of text are held at once.
+void read_pixels(
+  std::ifstream &file,
+  image_properties props,
+  uint8_t *buffer,
+  read_options const &options
+);
+
+struct write_options
+{
+  // Threads used to format PLAIN pixels, 0 means one per hardware thread.
+  unsigned num_threads = 1;
+  // Rows each thread formats at a time.
+  size_t rows_per_block = 64;
+  // Maps samples from [0, 255] to [0, maxval], as (v * maxval + 127) / 255,
+  // as they're encoded. The counterpart of read_options::rescale.
+  bool rescale = false;
+  // Throws if a sample is above maxval. Checked block by block as pixels are
+  // encoded, so output up to the bad block may have been written already
+  // (vector buffers are restored to their prior size).
+  bool validate = false;
+  // Ignores the maxval of `props` and writes the largest sample (at least 1)
+  // instead. Takes a pass over the pixels before encoding, as maxval goes in the header.
+  bool compute_maxval = false;
+  // 1-9 gzips the output at that deflate level, 0 leaves it uncompressed. Needs
+  // a build with PGM8_ZLIB defined, see README.
+  int gzip_level = 0;
+  // The following only apply when writing to a path on POSIX.
+  // Reserves the file's final size up front with posix_fallocate (F_PREALLOCATE on macOS).
+  bool preallocate = false;
+  // Writes with O_DIRECT, bypassing the page cache, where the filesystem supports it.
+  bool direct_io = false;
+};
+
+// Like the overload above, but formats PLAIN pixels on `options.num_threads`
+// threads, each taking a block of rows into its own buffer. Buffers are written
+// in row order, so output is identical to the single-threaded writer.
+void write(
+  std::ofstream &file,
+  image_properties props,
+  std::vector<std::string> const &comments,
+  uint8_t const *pixels,
+  write_options const &options
+);
+
+// Reads the `w` x `h` region with top-left corner (`x`, `y`) from a RAW image,
+// only touching the bytes of the rows it covers. `file` must be positioned at
+// the start of the raster (as it is for read_pixels); afterwards it is
+// positioned at the end of the raster. Row `i` of the region is written to
+// `dst + (i * dst_stride)`.
+void read_region(
+  std::ifstream &file,
+  image_properties props,
+  uint16_t x,
+  uint16_t y,
+  uint16_t w,
+  uint16_t h,
+  uint8_t *dst,
+  size_t dst_stride
+);
+
+// Reads pixels a row, or a batch of rows, at a time so memory use doesn't grow
+// with image height. Construct once the header and comments have been read;
+// `file` must outlive the reader. Reads no further than the raster, so `file`
+// needn't be seekable.
+class row_reader
+{
+public:
+  static constexpr size_t scratch_size = 64 * 1024;
+
+  row_reader(std::ifstream &file, image_properties props);
+
+  // Same, but PLAIN text or COMPRESSED data is staged in `scratch` instead of an
+  // internal allocation. `scratch` must hold `scratch_size` chars and outlive the reader.
+  row_reader(std::ifstream &file, image_properties props, char *scratch);
+
+  // Reads up to `max_rows` rows into `buffer`, which must hold
+  // `max_rows * width` pixels. Returns the number of rows read,
+  // 0 once every row has been read.
+  size_t read_rows(uint8_t *buffer, size_t max_rows);
+
+  [[nodiscard]] size_t rows_remaining() const noexcept;
+
+private:
+  std::ifstream &m_file;
+  image_properties m_props;
+  size_t m_num_rows_read = 0;
+  // PLAIN and COMPRESSED only, raster input not yet decoded
+  std::unique_ptr<char []> m_owned_block{};
+  char *m_block = nullptr;
+  size_t m_block_pos = 0, m_block_len = 0;
+  // COMPRESSED only, the last row read
+  std::unique_ptr<uint8_t []> m_prev_row{};
+};
+
+// Writes an image a row, or a batch of rows, at a time. The header and comments
+// are written on construction. Call close() after the last row, it throws
+// unless exactly `height` rows were written. `file` must outlive the writer.
+class row_writer
+{
+public:
+  row_writer(
+    std::ofstream &file,
+    image_properties props,
+    std::vector<std::string> const &comments
+  );
+  row_writer(row_writer const &) = delete;
+  row_writer &operator=(row_writer const &) = delete;
+  ~row_writer();
+
+  // `rows` holds `num_rows * width` pixels.
+  // Throws if this would exceed `height` rows in total.
+  void write_rows(uint8_t const *rows, size_t num_rows);
+
+  void close();
+
+  [[nodiscard]] size_t rows_remaining() const noexcept;
+
+private:
+  void flush_block();
+
+  std::ofstream &m_file;
+  image_properties m_props;
+  size_t m_num_rows_written = 0;
+  // PLAIN and COMPRESSED only, output not yet written
+  std::unique_ptr<char []> m_block{};
+  size_t m_block_len = 0;
+  // COMPRESSED only, the last row written followed by scratch for encoding the next
+  std::unique_ptr<uint8_t []> m_compressed_state{};
+};
+
+// Largest factor read_downscaled shrinks by.
+inline constexpr uint16_t max_downscale_factor = 256;
+
+// Properties of an image shrunk by `factor` in both dimensions, rounded up.
+[[nodiscard]] image_properties downscaled_properties(image_properties props, uint16_t factor);
+
+// Reads the pixels of an image shrunk by `factor` (1 to max_downscale_factor)
+// in both dimensions. Each output pixel is the rounded average of a `factor` x
+// `factor` box of input pixels, narrower or shorter at the right and bottom
+// edges. Rows are summed as they're decoded, so the full-size image is never
+// held in memory. `buffer` must hold downscaled_properties(props, factor).num_pixels()
+// pixels. Like read_pixels, `file` must be positioned at the start of the raster.
+void read_downscaled(
+  std::ifstream &file,
+  image_properties props,
+  uint16_t factor,
+  uint8_t *buffer
+);
+
+// Reads the images of a stream holding several back to back, as the netpbm spec
+// allows, such as one written by frame_writer. The pixel buffer is kept between
+// frames and only reallocated when a frame is larger than any before it. Nothing
+// past a frame is read, so `file` may be a pipe or FIFO.
+class frame_reader
+{
+public:
+  frame_reader(std::ifstream &file, read_options const &options = {});
+
+  // Reads the next frame, returns false once the stream has no more.
+  [[nodiscard]] bool next();
+
+  // Of the frame last read by next().
+  [[nodiscard]] image_properties get_properties() const noexcept;
+  [[nodiscard]] std::vector<std::string> const &get_comments() const noexcept;
+  // Valid until the next call to next().
+  [[nodiscard]] std::span<uint8_t const> get_pixels() const noexcept;
+
+  [[nodiscard]] size_t num_frames_read() const noexcept;
+
+private:
+  std::ifstream &m_file;
+  read_options m_options;
+  image_properties m_props{};
+  std::vector<std::string> m_comments{};
+  std::unique_ptr<uint8_t []> m_pixels{};
+  size_t m_capacity = 0;
+  size_t m_num_frames_read = 0;
+};
+
+// Appends images to a stream back to back, for frame_reader. The formatted
+// header of the last frame without comments is kept and reused for as long as
+// the properties stay the same. gzip_level isn't supported.
+class frame_writer
+{
+public:
+  frame_writer(std::ofstream &file, write_options const &options = {});
+
+  void write(image_properties props, uint8_t const *pixels);
+  void write(
+    image_properties props,
+    std::vector<std::string> const &comments,
+    uint8_t const *pixels
+  );
+
+  [[nodiscard]] size_t num_frames_written() const noexcept;
+
+private:
+  std::ofstream &m_file;
+  write_options m_options;
+  std::optional<image_properties> m_header_props{};
+  std::string m_header{};
+  size_t m_num_frames_written = 0;
+};
+
+// Hands out 64-byte aligned buffers, recycling released ones by power-of-two
+// size class instead of returning them to the heap, so repeated decodes of
+// similarly sized images stop allocating. Safe to share between threads.
+// Buffers must be released before their pool is destroyed.
+class buffer_pool
+{
+public:
+  static constexpr size_t alignment = 64;
+
+  // Owning handle to a pooled buffer, returns it to the pool on destruction.
+  class buffer
+  {
+  public:
+    buffer() = default;
+    buffer(buffer const &) = delete;
+    buffer &operator=(buffer const &) = delete;
+    buffer(buffer &&other) noexcept;
+    buffer &operator=(buffer &&other) noexcept;
+    ~buffer();
+
+    [[nodiscard]] uint8_t *data() const noexcept { return m_data; }
+    [[nodiscard]] size_t size() const noexcept { return m_size; }
+
+  private:
+    friend class buffer_pool;
+
+    buffer_pool *m_pool = nullptr;
+    uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+    unsigned m_size_class = 0;
+  };
+
+  buffer_pool() = default;
+  buffer_pool(buffer_pool const &) = delete;
+  buffer_pool &operator=(buffer_pool const &) = delete;
+  ~buffer_pool();
+
+  // Throws std::bad_alloc if `size` is past the largest size class, 2^63.
+  [[nodiscard]] buffer acquire(size_t size);
+
+  // Frees every cached buffer.
+  void trim() noexcept;
+
+  // Acquisitions served from a cached buffer and ones that had to allocate.
+  [[nodiscard]] size_t num_hits() const noexcept;
+  [[nodiscard]] size_t num_misses() const noexcept;
+
+private:
+  static constexpr unsigned s_num_size_classes = 64;
+
+  void release(uint8_t *data, unsigned size_class) noexcept;
+
+  std::mutex m_mutex{};
+  std::array<std::vector<uint8_t *>, s_num_size_classes> m_free{};
+  std::atomic<size_t> m_num_hits = 0, m_num_misses = 0;
+};
+
+// Bump allocator of 64-byte aligned buffers that share one lifetime, such as
+// the images of one request. reset() releases everything at once and keeps the
+// memory for the next round. Not thread-safe, see local().
+class arena
+{
+public:
+  static constexpr size_t alignment = 64;
+
+  explicit arena(size_t block_size = 4 * 1024 * 1024);
+  arena(arena const &) = delete;
+  arena &operator=(arena const &) = delete;
+  ~arena();
+
+  [[nodiscard]] uint8_t *allocate(size_t size);
+
+  void reset() noexcept;
+
+  // Allocations served from existing blocks and ones that needed a new block.
+  [[nodiscard]] size_t num_hits() const noexcept { return m_num_hits; }
+  [[nodiscard]] size_t num_misses() const noexcept { return m_num_misses; }
+
+  // The calling thread's own arena.
+  [[nodiscard]] static arena &local();
+
+private:
+  struct block
+  {
+    uint8_t *data;
+    size_t size;
+  };
+
+  size_t m_block_size;
+  std::vector<block> m_blocks{};
+  size_t m_current = 0, m_offset = 0;
+  size_t m_num_hits = 0, m_num_misses = 0;
+};
+
+// Like read_pixels above, but decodes into a buffer taken from `pool`.
+[[nodiscard]] buffer_pool::buffer read_pixels(
+  std::ifstream &file,
+  image_properties props,
+  buffer_pool &pool
+);
+
+// Like read_pixels above, but decodes into a buffer taken from `arena`,
+// valid until the arena is reset.
+[[nodiscard]] uint8_t *read_pixels(
+  std::ifstream &file,
+  image_properties props,
+  arena &arena
+);
+
+// An owned image whose rows are 64-byte aligned, so SIMD code can use aligned
+// loads on every row. Row `r` starts at `data() + (r * stride())`, where
+// `stride()` is `width` rounded up to a multiple of 64; padding bytes are zero.
+class image
+{
+public:
+  static constexpr size_t alignment = 64;
+
+  image() = default;
+  // Allocates a zeroed raster for `props`.
+  explicit image(image_properties props, std::vector<std::string> comments = {});
+
+  image(image const &) = delete;
+  image &operator=(image const &) = delete;
+  image(image &&other) noexcept;
+  image &operator=(image &&other) noexcept;
+  ~image();
+
+  [[nodiscard]] image_properties get_properties() const noexcept { return m_props; }
+  [[nodiscard]] std::vector<std::string> const &get_comments() const noexcept { return m_comments; }
+  void set_comments(std::vector<std::string> comments) { m_comments = std::move(comments); }
+
+  [[nodiscard]] size_t stride() const noexcept { return m_stride; }
+  [[nodiscard]] uint8_t *data() noexcept { return m_data; }
+  [[nodiscard]] uint8_t const *data() const noexcept { return m_data; }
+  [[nodiscard]] uint8_t *row(size_t const r) noexcept { return m_data + (r * m_stride); }
+  [[nodiscard]] uint8_t const *row(size_t const r) const noexcept { return m_data + (r * m_stride); }
+
+private:
+  image_properties m_props{};
+  std::vector<std::string> m_comments{};
+  uint8_t *m_data = nullptr;
+  size_t m_stride = 0;
+};
+
+// Reads the header, comments and pixels of the file at `path` in one go,
+// decoding each row straight into place. Gzipped files are inflated on the fly
+// in builds with PGM8_ZLIB defined, as they are by read_batch and read_batch_async.
+[[nodiscard]] image read(std::string const &path);
+
+// Writes `img` to the file at `path`.
+void write(std::string const &path, image const &img);
+
+// Writes an image to the file at `path`, replacing it. On POSIX this bypasses
+// iostreams: the header is formatted into one buffer and written along with
+// the raster by a single writev. If the write throws, the file is left empty.
+void write(
+  std::string const &path,
+  image_properties props,
+  std::vector<std::string> const &comments,
+  uint8_t const *pixels,
+  write_options const &options = {}
+);
+
+// In-memory counterparts of the functions above. Each decodes from the start of
+// `buffer` and reports how many bytes it used, either through `num_consumed` or
+// as the return value; advance the buffer by that amount for the next call.
+
+[[nodiscard]] image_properties read_properties(
+  std::span<uint8_t const> buffer,
+  size_t &num_consumed
+);
+
+[[nodiscard]] std::vector<std::string> read_comments(
+  std::span<uint8_t const> buffer,
+  size_t &num_consumed
+);
+
+size_t skip_comments(
+  std::span<uint8_t const> buffer,
+  size_t &num_consumed
+);
+
+// Returns the number of bytes consumed.
+size_t read_pixels(
+  std::span<uint8_t const> buffer,
+  image_properties props,
+  uint8_t *pixels
+);
+
+// Returns the number of bytes consumed.
+size_t read_pixels(
+  std::span<uint8_t const> buffer,
+  image_properties props,
+  uint8_t *pixels,
+  read_options const &options
+);
+
+// Encodes into `buffer`, returns the number of bytes produced.
+// Throws if `buffer` is too small, see max_encoded_size.
+size_t write(
+  std::span<uint8_t> buffer,
+  image_properties props,
+  std::vector<std::string> const &comments,
+  uint8_t const *pixels
+);
+
+// Appends to `buffer`, returns the number of bytes produced.
+size_t write(
+  std::vector<uint8_t> &buffer,
+  image_properties props,
+  std::vector<std::string> const &comments,
+  uint8_t const *pixels
+);
+
+// Appends to `buffer`, returns the number of bytes produced.
+size_t write(
+  std::vector<uint8_t> &buffer,
+  image_properties props,
+  std::vector<std::string> const &comments,
+  uint8_t const *pixels,
+  write_options const &options
+);
+
+// Upper bound on the number of bytes `write` produces for an image.
+[[nodiscard]] size_t max_encoded_size(
+  image_properties props,
+  std::vector<std::string> const &comments
+);
+
+// One decoded file of a batch.
+struct batch_item
+{
+  // Position of the file in the `paths` given to read_batch.
+  size_t index;
+  image_properties props;
+  std::vector<std::string> comments;
+  std::unique_ptr<uint8_t []> pixels;
+  // Set instead of the fields above if the file failed to decode.
+  std::exception_ptr error;
+};
+
+enum class batch_order : uint8_t
+{
+  // Items are delivered in the order of `paths`.
+  INPUT,
+  // Items are delivered as soon as they're decoded.
+  COMPLETION,
+};
+
+struct batch_options
+{
+  // Decoding threads, 0 means one per hardware thread.
+  unsigned num_threads = 0;
+  // Most pixel bytes decoded but not yet handed to the callback, 0 means no limit.
+  // A file larger than this is still decoded, on its own.
+  size_t max_in_flight_bytes = 256 * 1024 * 1024;
+  batch_order order = batch_order::COMPLETION;
+};
+
+// Decodes many files concurrently on a work-stealing thread pool, calling
+// `callback` once per file. Calls to `callback` never overlap. A file that fails
+// to decode is reported through `batch_item::error` without stopping the batch.
+// Decoding stalls while `max_in_flight_bytes` is reached, until the callback
+// has consumed earlier items. If `callback` throws, no further files are
+// started and the exception is rethrown once in-progress files are done.
+void read_batch(
+  std::vector<std::string> const &paths,
+  std::function<void (batch_item &&)> const &callback,
+  batch_options const &options = {}
+);
+
+// Decodes many files concurrently, returning one item per path in `paths` order.
+[[nodiscard]] std::vector<batch_item> read_batch(
+  std::vector<std::string> const &paths,
+  batch_options const &options = {}
+);
+
+struct async_read_options
+{
+  // Files being read at once, i.e. the io_uring queue depth.
+  unsigned queue_depth = 64;
+  // Threads used by the read_batch fallback, 0 means one per hardware thread.
+  unsigned fallback_num_threads = 0;
+  // Use the read_batch fallback even when io_uring is available.
+  bool force_fallback = false;
+};
+
+// Like read_batch in COMPLETION order, but on Linux submits the open and read
+// requests of up to `options.queue_depth` files at once through io_uring, on the
+// calling thread. Headers are parsed as their reads complete, and the rest of a
+// RAW raster is read straight into its pixel buffer. Falls back to read_batch
+// when io_uring is unavailable. Returns true if io_uring was used.
+bool read_batch_async(
+  std::vector<std::string> const &paths,
+  std::function<void (batch_item &&)> const &callback,
+  async_read_options const &options = {}
+);
+
+// Writes many images into one archive file, as RAW rasters each starting at a
+// multiple of `alignment`, followed by an index of their names and properties.
+// The index is written by close(), or by the destructor if close() wasn't called.
+class archive_writer
+{
+public:
+  static constexpr size_t alignment = 4096;
+
+  explicit archive_writer(std::string const &path);
+
+  archive_writer(archive_writer const &) = delete;
+  archive_writer &operator=(archive_writer const &) = delete;
+  ~archive_writer();
+
+  // Throws if `name` was already added.
+  void add(
+    std::string_view name,
+    image_properties props,
+    uint8_t const *pixels
+  );
+
+  void close();
+
+  [[nodiscard]] size_t size() const noexcept;
+
+private:
+  struct record
+  {
+    std::string name;
+    image_properties props;
+    uint64_t raster_offset;
+  };
+
+  void write_index();
+
+  std::ofstream m_file;
+  std::vector<record> m_records{};
+  std::unordered_set<std::string> m_names{};
+  uint64_t m_offset = 0;
+  bool m_closed = false;
+};
+
+// A 65535 pixel dimension is down to 1 after 16 halvings.
+inline constexpr unsigned max_pyramid_levels = 17;
+
+struct pyramid_options
+{
+  // Threads computing bands of rows and writing levels, 0 means one per hardware thread.
+  unsigned num_threads = 0;
+  // Writes every level into one archive, `base_path`.pgma with entries named
+  // after the level ("0", "1", ...), instead of a file per level.
+  bool archive = false;
+};
+
+// Writes a mipmap pyramid of `levels` levels, level 0 being the image itself
+// and each further level half the size of the one before (rounded up), its
+// pixels the rounded averages of 2x2 boxes. All levels are computed in one
+// pass over `pixels`, a band of rows at a time on several threads. Level `l` is
+// written to `base_path`.`l`.pgm in the format of `props`, or to an archive.
+void write_pyramid(
+  std::string const &base_path,
+  image_properties props,
+  uint8_t const *pixels,
+  unsigned levels,
+  pyramid_options const &options = {}
+);
+
+#if PGM8_POSIX
+
+// Access pattern hints passed on to madvise.
+enum class access_hint : uint8_t
+{
+  NORMAL,
+  SEQUENTIAL,
+  RANDOM,
+  WILL_NEED,
+};
+
+// Read-only view of a RAW image file mapped into memory. The header is parsed
+// in place and the raster is exposed without being copied. Unmapped on destruction.
+class mapped_image
+{
+public:
+  explicit mapped_image(std::string const &path, access_hint hint = access_hint::NORMAL);
+
+  mapped_image(mapped_image const &) = delete;
+  mapped_image &operator=(mapped_image const &) = delete;
+  mapped_image(mapped_image &&other) noexcept;
+  mapped_image &operator=(mapped_image &&other) noexcept;
+  ~mapped_image();
+
+  [[nodiscard]] image_properties get_properties() const noexcept;
+  [[nodiscard]] std::span<uint8_t const> get_pixels() const noexcept;
+
+  void advise(access_hint hint) const;
+
+private:
+  void *m_mapping = nullptr;
+  size_t m_mapping_size = 0;
+  size_t m_raster_offset = 0;
+  image_properties m_props{};
+};
+
+// Metadata of every .pgm file under a directory tree, kept in a compact binary
+// index file which is mapped into memory. Lookups don't touch the image files.
+class corpus_index
+{
+public:
+  struct entry
+  {
+    // Relative to the scanned root, with '/' separators.
+    std::string_view path;
+    int64_t mtime_ns;
+    uint64_t file_size;
+    image_properties props;
+    size_t raster_offset;
+  };
+
+  // Maps the index file at `index_path`, or starts empty if it doesn't exist yet.
+  explicit corpus_index(std::string index_path);
+
+  corpus_index(corpus_index const &) = delete;
+  corpus_index &operator=(corpus_index const &) = delete;
+  corpus_index(corpus_index &&other) noexcept;
+  corpus_index &operator=(corpus_index &&other) noexcept;
+  ~corpus_index();
+
+  // Rescans `root`, probing only files which are new or whose size or mtime
+  // changed, then replaces the index file and maps the new one. Files which
+  // fail to probe are left out. Returns the number of files probed.
+  size_t update(std::string const &root, unsigned num_threads = 0);
+
+  [[nodiscard]] size_t size() const noexcept;
+  [[nodiscard]] entry get_entry(size_t idx) const;
+  [[nodiscard]] std::optional<entry> find(std::string_view path) const;
+
+private:
+  std::string m_index_path;
+  void *m_mapping = nullptr;
+  size_t m_mapping_size = 0;
+};
+
+struct archive_entry
+{
+  std::string_view name;
+  // Always RAW.
+  image_properties props;
+  // Points into the mapping.
+  std::span<uint8_t const> pixels;
+};
+
+// Read-only view of an archive written by archive_writer, mapped into memory.
+// Images are found by index or by name without copying. Unmapped on destruction.
+class archive_reader
+{
+public:
+  explicit archive_reader(std::string const &path, access_hint hint = access_hint::NORMAL);
+
+  archive_reader(archive_reader const &) = delete;
+  archive_reader &operator=(archive_reader const &) = delete;
+  archive_reader(archive_reader &&other) noexcept;
+  archive_reader &operator=(archive_reader &&other) noexcept;
+  ~archive_reader();
+
+  [[nodiscard]] size_t size() const noexcept;
+  [[nodiscard]] archive_entry get_entry(size_t idx) const;
+  [[nodiscard]] std::optional<archive_entry> find(std::string_view name) const;
+
+  void advise(access_hint hint) const;
+
+private:
+  void *m_mapping = nullptr;
+  size_t m_mapping_size = 0;
+};
+
+#endif // PGM8_POSIX
+
 } // namespace pgm8
 
 #endif // NLUKA_PGM8_HPP
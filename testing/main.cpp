@@ -1,8 +1,17 @@
+#include <cstring>
 #include <iostream>
+#include <filesystem>
+#include <set>
 
 #include "ntest.hpp"
 #include "../pgm8.hpp"
 
+#if PGM8_POSIX
+# include <csignal>
+# include <thread>
+# include <sys/stat.h>
+#endif
+
 struct readonly_image
 {
   pgm8::image_properties const props;
@@ -94,6 +103,239 @@ void write_and_read_back_raw_test(
   }
 }
 
+void read_rows_test(
+  std::string const &path,
+  readonly_image const &expected_img,
+  size_t const rows_per_batch,
+  std::source_location const loc = std::source_location::current())
+{
+  std::ifstream file(path, std::ios::binary);
+  auto const props_found = pgm8::read_properties(file);
+  pgm8::skip_comments(file);
+
+  size_t const width = props_found.get_width();
+  std::unique_ptr<uint8_t []> batch(new uint8_t[rows_per_batch * width]);
+  std::vector<uint8_t> pixels_found{};
+
+  pgm8::row_reader reader(file, props_found);
+  size_t num_rows;
+  while ((num_rows = reader.read_rows(batch.get(), rows_per_batch)) > 0)
+    pixels_found.insert(pixels_found.end(), batch.get(), batch.get() + (num_rows * width));
+
+  ntest::assert_uint64(0, reader.rows_remaining(), loc);
+  assert_image(expected_img, { props_found, expected_img.comments, pixels_found.data() }, loc);
+}
+
+// Writes the image a few rows at a time, then reads it back with the regular API.
+void write_rows_test(
+  std::string const &path,
+  readonly_image const &input_img,
+  size_t const rows_per_batch,
+  std::source_location const loc = std::source_location::current())
+{
+  {
+    std::ofstream file(path, std::ios::binary);
+    pgm8::row_writer writer(file, input_img.props, input_img.comments);
+
+    size_t const width = input_img.props.get_width();
+    while (writer.rows_remaining() > 0) {
+      size_t const num_rows = std::min(rows_per_batch, writer.rows_remaining());
+      size_t const row_idx = input_img.props.get_height() - writer.rows_remaining();
+      writer.write_rows(input_img.pixels + (row_idx * width), num_rows);
+    }
+    writer.close();
+  }
+  {
+    std::ifstream file(path, std::ios::binary);
+    auto const props_found = pgm8::read_properties(file);
+    auto const comments_found = pgm8::read_comments(file);
+    std::unique_ptr<uint8_t []> pixels_found(new uint8_t[props_found.num_pixels()]);
+    pgm8::read_pixels(file, props_found, pixels_found.get());
+    assert_image(input_img, { props_found, comments_found, pixels_found.get() }, loc);
+  }
+}
+
+void read_region_test(
+  std::string const &path,
+  readonly_image const &full_img,
+  uint16_t const x,
+  uint16_t const y,
+  uint16_t const w,
+  uint16_t const h,
+  std::source_location const loc = std::source_location::current())
+{
+  size_t const stride = size_t{w} + 3;
+  std::vector<uint8_t> region(stride * h);
+  {
+    std::ifstream file(path, std::ios::binary);
+    auto const props_found = pgm8::read_properties(file);
+    pgm8::skip_comments(file);
+    pgm8::read_region(file, props_found, x, y, w, h, region.data(), stride);
+  }
+
+  std::vector<uint8_t> expected{}, actual{};
+  for (size_t r = 0; r < h; ++r)
+  {
+    uint8_t const *const expected_row = full_img.pixels + ((y + r) * full_img.props.get_width()) + x;
+    expected.insert(expected.end(), expected_row, expected_row + w);
+    actual.insert(actual.end(), region.data() + (r * stride), region.data() + (r * stride) + w);
+  }
+  ntest::assert_stdvec(expected, actual, loc);
+}
+
+void read_parallel_test(
+  std::string const &path,
+  readonly_image const &expected_img,
+  pgm8::read_options const &options,
+  std::source_location const loc = std::source_location::current())
+{
+  std::ifstream file(path, std::ios::binary);
+  auto const props_found = pgm8::read_properties(file);
+  pgm8::skip_comments(file);
+  std::unique_ptr<uint8_t []> pixels_found(new uint8_t[props_found.num_pixels()]);
+  pgm8::read_pixels(file, props_found, pixels_found.get(), options);
+  assert_image(expected_img, { props_found, expected_img.comments, pixels_found.get() }, loc);
+
+  // only the whitespace ending the raster is left in the stream
+  std::string rest{};
+  std::getline(file, rest);
+  ntest::assert_stdstr(" ", rest, ntest::default_str_opts(), loc);
+}
+
+void write_and_read_back_memory_test(
+  readonly_image const &input_img,
+  std::source_location const loc = std::source_location::current())
+{
+  std::vector<uint8_t> encoded{};
+  size_t const num_produced = pgm8::write(encoded, input_img.props, input_img.comments, input_img.pixels);
+  ntest::assert_uint64(encoded.size(), num_produced, loc);
+
+  std::span<uint8_t const> remaining(encoded);
+  size_t num_consumed = 0;
+
+  auto const props_found = pgm8::read_properties(remaining, num_consumed);
+  remaining = remaining.subspan(num_consumed);
+  auto const comments_found = pgm8::read_comments(remaining, num_consumed);
+  remaining = remaining.subspan(num_consumed);
+
+  std::unique_ptr<uint8_t []> pixels_found(new uint8_t[props_found.num_pixels()]);
+  remaining = remaining.subspan(pgm8::read_pixels(remaining, props_found, pixels_found.get()));
+
+  assert_image(input_img, { props_found, comments_found, pixels_found.get() }, loc);
+  ntest::assert_stdvec(input_img.comments, comments_found, loc);
+  // only the whitespace ending a plain raster is left over
+  ntest::assert_bool(true, remaining.size() <= 2, loc);
+}
+
+// Decodes an image encoded in memory, returning its pixels.
+std::vector<uint8_t> read_memory(
+  std::vector<uint8_t> const &encoded,
+  pgm8::read_options const &options)
+{
+  std::span<uint8_t const> remaining(encoded);
+  size_t num_consumed = 0;
+  auto const props = pgm8::read_properties(remaining, num_consumed);
+  remaining = remaining.subspan(num_consumed);
+  pgm8::skip_comments(remaining, num_consumed);
+  remaining = remaining.subspan(num_consumed);
+
+  std::vector<uint8_t> pixels(props.num_pixels());
+  pgm8::read_pixels(remaining, props, pixels.data(), options);
+  return pixels;
+}
+
+// Pixels for the downscaling tests, varying at every scale.
+std::vector<uint8_t> downscale_test_pixels(pgm8::image_properties const props)
+{
+  std::vector<uint8_t> pixels(props.num_pixels());
+  for (size_t i = 0; i < pixels.size(); ++i)
+    pixels[i] = static_cast<uint8_t>((i * 7) ^ (i >> 3));
+  return pixels;
+}
+
+// Straightforward box filter: the rounded average of each `factor` x `factor`
+// box, narrower or shorter at the right and bottom edges.
+std::vector<uint8_t> box_filter(
+  std::vector<uint8_t> const &pixels,
+  pgm8::image_properties const props,
+  size_t const factor)
+{
+  size_t const width = props.get_width(), height = props.get_height();
+  std::vector<uint8_t> out{};
+  for (size_t oy = 0; oy < (height + factor - 1) / factor; ++oy)
+    for (size_t ox = 0; ox < (width + factor - 1) / factor; ++ox)
+    {
+      size_t sum = 0, count = 0;
+      for (size_t y = oy * factor; y < std::min(height, (oy + 1) * factor); ++y)
+        for (size_t x = ox * factor; x < std::min(width, (ox + 1) * factor); ++x, ++count)
+          sum += pixels[(y * width) + x];
+      out.push_back(static_cast<uint8_t>((sum + (count / 2)) / count));
+    }
+  return out;
+}
+
+#if PGM8_POSIX
+void read_mapped_test(
+  std::string const &path,
+  readonly_image const &expected_img,
+  std::source_location const loc = std::source_location::current())
+{
+  pgm8::mapped_image const mapped(path, pgm8::access_hint::SEQUENTIAL);
+  auto const pixels = mapped.get_pixels();
+  assert_image(expected_img, { mapped.get_properties(), expected_img.comments, pixels.data() }, loc);
+}
+
+// Serves `content` through a FIFO at `path` from another thread, so it can be
+// read as a stream that can't seek. Must outlive the reading stream.
+class fifo_feed
+{
+public:
+  fifo_feed(std::string const &path, std::string content)
+    : m_path(path)
+  {
+    // a reader that gives up early must not kill the writer
+    std::signal(SIGPIPE, SIG_IGN);
+    std::filesystem::remove(path);
+    if (::mkfifo(path.c_str(), 0600) != 0)
+      throw std::runtime_error("mkfifo failed");
+    m_writer = std::thread([path, content = std::move(content)]() {
+      std::ofstream file(path, std::ios::binary);
+      file.write(content.data(), static_cast<std::streamsize>(content.size()));
+    });
+  }
+
+  ~fifo_feed()
+  {
+    m_writer.join();
+    std::filesystem::remove(m_path);
+  }
+
+private:
+  std::string m_path;
+  std::thread m_writer;
+};
+#endif
+
+void write_text_file(std::string const &path, char const *content)
+{
+  std::ofstream file(path);
+  file << content;
+}
+
+void read_malformed_plain_test(
+  std::string const &path,
+  char const *content,
+  std::source_location const loc = std::source_location::current())
+{
+  write_text_file(path, content);
+  std::ifstream file(path);
+  auto const props = pgm8::read_properties(file);
+  std::unique_ptr<uint8_t []> pixels(new uint8_t[props.num_pixels()]);
+  ntest::assert_throws<std::runtime_error>([&]() {
+    pgm8::read_pixels(file, props, pixels.get());
+  }, loc);
+}
+
 int main()
 {
   try
@@ -234,10 +476,12 @@ int main()
       props.set_format(pgm8::format::PLAIN);
       write_and_read_back_plain_test("files/with_comments/horiz-grad", { props, comments, pixels });
       read_but_skip_comments_test("files/with_comments/horiz-grad", { props, comments, pixels }, comments.size());
+      write_and_read_back_memory_test({ props, comments, pixels });
 
       props.set_format(pgm8::format::RAW);
       write_and_read_back_raw_test("files/with_comments/horiz-grad", { props, comments, pixels });
       read_but_skip_comments_test("files/with_comments/horiz-grad", { props, comments, pixels }, comments.size());
+      write_and_read_back_memory_test({ props, comments, pixels });
     }
 
     // vertical gradient, no comments
@@ -381,6 +625,1084 @@ int main()
       read_but_skip_comments_test("files/no_comments/triple-digit-maxval", { props, comments, pixels }, comments.size());
     }
 
+    // large image, spans several read blocks
+    {
+      uint16_t const width = 640, height = 480;
+      std::unique_ptr<uint8_t []> pixels(new uint8_t[width * height]);
+      for (size_t i = 0; i < static_cast<size_t>(width) * height; ++i)
+        pixels[i] = static_cast<uint8_t>((i * 7) ^ (i >> 5));
+
+      pgm8::image_properties props;
+      props.set_width(width);
+      props.set_height(height);
+      props.set_maxval(255);
+
+      std::vector<std::string> const comments{ "large" };
+
+      props.set_format(pgm8::format::PLAIN);
+      write_and_read_back_plain_test("files/with_comments/large", { props, comments, pixels.get() });
+
+      write_and_read_back_memory_test({ props, comments, pixels.get() });
+      read_rows_test("files/with_comments/large.plain.pgm", { props, comments, pixels.get() }, 1);
+      read_rows_test("files/with_comments/large.plain.pgm", { props, comments, pixels.get() }, 7);
+      write_rows_test("files/with_comments/large-rows.plain.pgm", { props, comments, pixels.get() }, 5);
+      read_parallel_test("files/with_comments/large.plain.pgm", { props, comments, pixels.get() }, { .num_threads = 4, .chunk_size = 1000 });
+      read_parallel_test("files/with_comments/large.plain.pgm", { props, comments, pixels.get() }, { .num_threads = 0 });
+#if PGM8_POSIX
+      {
+        // through a stream that can't seek, so no more than the raster may be read
+        std::ifstream src("files/with_comments/large.plain.pgm", std::ios::binary);
+        std::string content(std::istreambuf_iterator<char>(src), {});
+        fifo_feed const feed("files/large.fifo", std::move(content));
+        read_parallel_test("files/large.fifo", { props, comments, pixels.get() }, { .num_threads = 4, .chunk_size = 1000 });
+      }
+#endif
+      {
+        std::vector<uint8_t> encoded{};
+        pgm8::write(encoded, props, {}, pixels.get());
+        size_t num_consumed;
+        auto const props_found = pgm8::read_properties(encoded, num_consumed);
+        std::vector<uint8_t> pixels_found(props_found.num_pixels());
+        pgm8::read_pixels(std::span(encoded).subspan(num_consumed), props_found, pixels_found.data(), { .num_threads = 3, .chunk_size = 777 });
+        ntest::assert_arr(pixels.get(), props.num_pixels(), pixels_found.data(), pixels_found.size());
+
+        // multi-threaded encode gives identical output
+        std::vector<uint8_t> encoded_parallel{};
+        pgm8::write(encoded_parallel, props, {}, pixels.get(), { .num_threads = 3, .rows_per_block = 7 });
+        ntest::assert_stdvec(encoded, encoded_parallel);
+      }
+
+      props.set_format(pgm8::format::RAW);
+      write_and_read_back_raw_test("files/with_comments/large", { props, comments, pixels.get() });
+      write_and_read_back_memory_test({ props, comments, pixels.get() });
+      read_rows_test("files/with_comments/large.raw.pgm", { props, comments, pixels.get() }, 1);
+      read_rows_test("files/with_comments/large.raw.pgm", { props, comments, pixels.get() }, 7);
+      write_rows_test("files/with_comments/large-rows.raw.pgm", { props, comments, pixels.get() }, 5);
+
+      read_region_test("files/with_comments/large.raw.pgm", { props, comments, pixels.get() }, 10, 20, 30, 40);
+      read_region_test("files/with_comments/large.raw.pgm", { props, comments, pixels.get() }, 600, 470, 40, 10);
+      read_region_test("files/with_comments/large.raw.pgm", { props, comments, pixels.get() }, 0, 100, width, 3);
+      ntest::assert_throws<std::runtime_error>([&]() {
+        read_region_test("files/with_comments/large.raw.pgm", { props, comments, pixels.get() }, 600, 0, 41, 1);
+      });
+
+      // closing an incomplete image
+      ntest::assert_throws<std::runtime_error>([&]() {
+        std::ofstream file("files/incomplete.raw.pgm", std::ios::binary);
+        pgm8::row_writer writer(file, props, comments);
+        writer.write_rows(pixels.get(), 1);
+        writer.close();
+      });
+
+#ifdef __linux__
+      // write errors reported by a stream with exceptions enabled
+      ntest::assert_throws<std::ios_base::failure>([&]() {
+        auto plain_props = props;
+        plain_props.set_format(pgm8::format::PLAIN);
+        std::ofstream file("/dev/full");
+        file.exceptions(std::ios::badbit);
+        pgm8::row_writer writer(file, plain_props, comments);
+        writer.write_rows(pixels.get(), plain_props.get_height());
+        writer.close();
+      });
+#endif
+
+      // caller-provided buffer that is too small
+      ntest::assert_throws<std::runtime_error>([&]() {
+        std::vector<uint8_t> too_small(props.num_pixels());
+        pgm8::write(std::span<uint8_t>(too_small), props, comments, pixels.get());
+      });
+
+#if PGM8_POSIX
+      read_mapped_test("files/with_comments/large.raw.pgm", { props, comments, pixels.get() });
+      ntest::assert_throws<std::runtime_error>([]() {
+        pgm8::mapped_image const mapped("files/with_comments/large.plain.pgm");
+      });
+#endif
+    }
+
+    // exact plain output
+    {
+      uint8_t const pixels[6] { 0, 9, 10, 99, 100, 255 };
+
+      pgm8::image_properties props;
+      props.set_width(3);
+      props.set_height(2);
+      props.set_maxval(255);
+      props.set_format(pgm8::format::PLAIN);
+
+      {
+        std::ofstream file("files/exact.plain.pgm");
+        pgm8::write(file, props, { "c" }, pixels);
+      }
+      write_text_file("files/exact.expected.pgm", "P2\n3 2\n255\n#c\n0 9 10 \n99 100 255 \n");
+      ntest::assert_text_file("files/exact.expected.pgm", "files/exact.plain.pgm");
+    }
+
+    // comments and whitespace within the header
+    {
+      char const *const content = "P2\n# one\n3 # two\n\t2\n# three\n255\n#four\n0 1 2\n3 4 5\n";
+      write_text_file("files/spec-header.pgm", content);
+      uint8_t const expected_pixels[6] { 0, 1, 2, 3, 4, 5 };
+
+      {
+        std::ifstream file("files/spec-header.pgm", std::ios::binary);
+        auto const hdr = pgm8::read_header(file);
+        ntest::assert_uint16(3, hdr.get_properties().get_width());
+        ntest::assert_uint16(2, hdr.get_properties().get_height());
+        ntest::assert_uint8(255, hdr.get_properties().get_maxval());
+        ntest::assert_uint64(std::strlen(content) - 12, hdr.get_raster_offset());
+
+        std::vector<std::string> comments{};
+        for (size_t i = 0; i < hdr.num_comments(); ++i)
+          comments.emplace_back(hdr.get_comment(i));
+        ntest::assert_stdvec(std::vector<std::string>{ " one", " two", " three", "four" }, comments);
+
+        uint8_t pixels[6];
+        pgm8::read_pixels(file, hdr.get_properties(), pixels);
+        ntest::assert_arr(expected_pixels, 6, pixels, 6);
+      }
+      {
+        // read_properties skips comments up to maxval, read_comments gets the rest
+        std::ifstream file("files/spec-header.pgm", std::ios::binary);
+        auto const props = pgm8::read_properties(file);
+        ntest::assert_stdvec(std::vector<std::string>{ "four" }, pgm8::read_comments(file));
+        uint8_t pixels[6];
+        pgm8::read_pixels(file, props, pixels);
+        ntest::assert_arr(expected_pixels, 6, pixels, 6);
+      }
+      {
+        std::vector<uint8_t> const buffer(content, content + std::strlen(content));
+        auto const hdr = pgm8::read_header(buffer);
+        ntest::assert_uint64(4, hdr.num_comments());
+      }
+#if PGM8_POSIX
+      {
+        // headers are read without reading ahead, so a stream that can't seek works
+        fifo_feed const feed("files/header.fifo", "P5\n# one\n3 2\n255\n#two\nABCDEFP5 2 1 255\nGHP2 3 1 255\n7 8 9\nP5 1 1 255\nZ");
+        std::ifstream file("files/header.fifo", std::ios::binary);
+
+        auto const hdr = pgm8::read_header(file);
+        ntest::assert_uint64(2, hdr.num_comments());
+        uint8_t pixels[6];
+        pgm8::read_pixels(file, hdr.get_properties(), pixels);
+        ntest::assert_cstr("ABCDEF", std::string(pixels, pixels + 6).c_str());
+
+        auto const props = pgm8::read_properties(file);
+        ntest::assert_bool(true, pgm8::read_comments(file).empty());
+        pgm8::read_pixels(file, props, pixels);
+        ntest::assert_cstr("GH", std::string(pixels, pixels + 2).c_str());
+
+        // PLAIN rasters are read no further than their last digit
+        pgm8::read_pixels(file, pgm8::read_properties(file), pixels);
+        ntest::assert_arr(std::array<uint8_t, 3>{ 7, 8, 9 }.data(), 3, pixels, 3);
+        file >> std::ws;
+        pgm8::read_pixels(file, pgm8::read_properties(file), pixels);
+        ntest::assert_uint8('Z', pixels[0]);
+      }
+#endif
+    }
+
+    // malformed plain pixel data
+    {
+      read_malformed_plain_test("files/out-of-range.pgm", "P2\n2 2\n255\n0 1 256 3\n");
+      read_malformed_plain_test("files/bad-char.pgm", "P2\n2 2\n255\n0 1 2x 3\n");
+      read_malformed_plain_test("files/truncated.pgm", "P2\n2 2\n255\n0 1 2\n");
+
+      std::string const what = ntest::assert_throws<std::runtime_error>([]() {
+        write_text_file("files/out-of-range-parallel.pgm", "P2\n4 2\n255\n0 1 2 3 \n4 5 256 7\n");
+        std::ifstream file("files/out-of-range-parallel.pgm");
+        auto const props = pgm8::read_properties(file);
+        uint8_t pixels[8];
+        pgm8::read_pixels(file, props, pixels, { .num_threads = 4, .chunk_size = 2 });
+      });
+      ntest::assert_stdstr("pixel 6 out of range (> 255)", what);
+
+      // tokens longer than a chunk
+      {
+        write_text_file("files/long-token.pgm", "P2\n3 1\n255\n0000000000000001 2 3\nP5 1 1 255\nZ");
+        std::ifstream file("files/long-token.pgm", std::ios::binary);
+        uint8_t pixels[3];
+        pgm8::read_pixels(file, pgm8::read_properties(file), pixels, { .num_threads = 4, .chunk_size = 1 });
+        ntest::assert_arr(std::array<uint8_t, 3>{ 1, 2, 3 }.data(), 3, pixels, 3);
+        file >> std::ws;
+        pgm8::read_pixels(file, pgm8::read_properties(file), pixels);
+        ntest::assert_uint8('Z', pixels[0]);
+      }
+    }
+
+    // owning image
+    for (auto const fmt : { pgm8::format::PLAIN, pgm8::format::RAW })
+    {
+      pgm8::image const original = pgm8::read("files/with_comments/large.raw.pgm");
+      ntest::assert_uint64(0, reinterpret_cast<uintptr_t>(original.data()) % pgm8::image::alignment);
+      ntest::assert_uint64(640, original.stride());
+
+      pgm8::image_properties props = original.get_properties();
+      props.set_width(100);
+      props.set_height(50);
+      props.set_format(fmt);
+
+      pgm8::image cropped(props, { "cropped" });
+      ntest::assert_uint64(128, cropped.stride());
+      for (size_t r = 0; r < props.get_height(); ++r)
+        std::memcpy(cropped.row(r), original.row(r + 3) + 7, props.get_width());
+
+      pgm8::write("files/with_comments/cropped.pgm", cropped);
+      pgm8::image const read_back = pgm8::read("files/with_comments/cropped.pgm");
+
+      ntest::assert_stdvec(cropped.get_comments(), read_back.get_comments());
+      ntest::assert_uint64(cropped.stride(), read_back.stride());
+      ntest::assert_arr(cropped.data(), cropped.stride() * props.get_height(), read_back.data(), read_back.stride() * props.get_height());
+    }
+
+    // pooled and arena decodes
+    {
+      std::string const path = "files/with_comments/large.raw.pgm";
+      pgm8::buffer_pool pool;
+
+      auto const read_pooled = [&pool](std::string const &p)
+      {
+        std::ifstream file(p, std::ios::binary);
+        auto const props = pgm8::read_properties(file);
+        pgm8::skip_comments(file);
+        return pgm8::read_pixels(file, props, pool);
+      };
+
+      std::vector<uint8_t> first_pixels{};
+      {
+        auto const buf = read_pooled(path);
+        ntest::assert_uint64(0, reinterpret_cast<uintptr_t>(buf.data()) % pgm8::buffer_pool::alignment);
+        first_pixels.assign(buf.data(), buf.data() + buf.size());
+      }
+      for (int i = 0; i < 3; ++i) {
+        auto const buf = read_pooled(path);
+        ntest::assert_arr(first_pixels.data(), first_pixels.size(), buf.data(), buf.size());
+      }
+      ntest::assert_uint64(1, pool.num_misses());
+      ntest::assert_uint64(3, pool.num_hits());
+      ntest::assert_throws<std::bad_alloc>([&pool]() { static_cast<void>(pool.acquire(SIZE_MAX)); });
+      ntest::assert_throws<std::bad_alloc>([&pool]() { static_cast<void>(pool.acquire((SIZE_MAX >> 1) + 2)); });
+
+      pgm8::arena &arena = pgm8::arena::local();
+      for (int round = 0; round < 2; ++round)
+      {
+        arena.reset();
+        for (char const *const p : { "files/with_comments/large.raw.pgm", "files/with_comments/large.plain.pgm" })
+        {
+          std::ifstream file(p, std::ios::binary);
+          auto const props = pgm8::read_properties(file);
+          pgm8::skip_comments(file);
+          uint8_t const *const pixels = pgm8::read_pixels(file, props, arena);
+          ntest::assert_uint64(0, reinterpret_cast<uintptr_t>(pixels) % pgm8::arena::alignment);
+          ntest::assert_arr(first_pixels.data(), first_pixels.size(), pixels, props.num_pixels());
+        }
+      }
+      ntest::assert_uint64(1, arena.num_misses());
+      ntest::assert_uint64(3, arena.num_hits());
+    }
+
+    // batch reads
+    {
+      // header too long for the first asynchronous read
+      {
+        std::vector<std::string> comments(300, "a fairly long comment line to push the raster back");
+        uint8_t const pixels[4] { 1, 2, 3, 4 };
+        pgm8::image_properties props;
+        props.set_width(2);
+        props.set_height(2);
+        props.set_maxval(4);
+        props.set_format(pgm8::format::RAW);
+        std::ofstream file("files/long-header.raw.pgm", std::ios::binary);
+        pgm8::write(file, props, comments, pixels);
+      }
+
+      ntest::assert_throws<std::runtime_error>([]() {
+        std::ifstream file("files/long-header.raw.pgm", std::ios::binary);
+        static_cast<void>(pgm8::read_header(file));
+      });
+
+      std::vector<std::string> const paths {
+        "files/with_comments/large.raw.pgm",
+        "files/no_comments/horiz.plain.pgm",
+        "files/does-not-exist.pgm",
+        "files/with_comments/vert-grad.raw.pgm",
+        "files/with_comments/large.plain.pgm",
+        "files/bad-char.pgm",
+        "files/long-header.raw.pgm",
+      };
+
+      auto const expect_batch_item = [&paths](
+        pgm8::batch_item const &item,
+        std::source_location const loc = std::source_location::current())
+      {
+        bool const should_fail = (item.index == 2 || item.index == 5);
+        ntest::assert_bool(should_fail, static_cast<bool>(item.error), loc);
+        if (should_fail)
+          return;
+
+        std::ifstream file(paths[item.index], std::ios::binary);
+        auto const props = pgm8::read_properties(file);
+        auto const comments = pgm8::read_comments(file);
+        std::unique_ptr<uint8_t []> pixels(new uint8_t[props.num_pixels()]);
+        pgm8::read_pixels(file, props, pixels.get());
+        assert_image({ props, comments, pixels.get() }, { item.props, item.comments, item.pixels.get() }, loc);
+      };
+
+      auto const items = pgm8::read_batch(paths, { .num_threads = 3 });
+      ntest::assert_uint64(paths.size(), items.size());
+      for (size_t i = 0; i < items.size(); ++i) {
+        ntest::assert_uint64(i, items[i].index);
+        expect_batch_item(items[i]);
+      }
+
+      // in input order, with a budget smaller than the large images
+      std::vector<size_t> delivery_order{};
+      pgm8::read_batch(paths, [&](pgm8::batch_item &&item) {
+        delivery_order.push_back(item.index);
+        expect_batch_item(item);
+      }, { .num_threads = 4, .max_in_flight_bytes = 1000, .order = pgm8::batch_order::INPUT });
+      ntest::assert_stdvec(std::vector<size_t>{ 0, 1, 2, 3, 4, 5, 6 }, delivery_order);
+
+      // asynchronous, with io_uring where available and with the fallback
+      for (bool const force_fallback : { false, true })
+      {
+        std::vector<uint8_t> delivered(paths.size(), 0);
+        bool const used_io_uring = pgm8::read_batch_async(paths, [&](pgm8::batch_item &&item) {
+          delivered[item.index] = 1;
+          expect_batch_item(item);
+        }, { .queue_depth = 4, .force_fallback = force_fallback });
+
+        ntest::assert_stdvec(std::vector<uint8_t>(paths.size(), 1), delivered);
+        if (force_fallback)
+          ntest::assert_bool(false, used_io_uring);
+      }
+
+      // header-only probes
+      {
+        std::vector<std::string> const comments(30, "enough comments to need a second read");
+        uint8_t const pixels[1] { 7 };
+        pgm8::image_properties props;
+        props.set_width(1);
+        props.set_height(1);
+        props.set_maxval(7);
+        props.set_format(pgm8::format::PLAIN);
+        std::ofstream file("files/medium-header.plain.pgm", std::ios::binary);
+        pgm8::write(file, props, comments, pixels);
+      }
+
+      std::vector<std::string> probe_paths = paths;
+      probe_paths.push_back("files/medium-header.plain.pgm");
+
+      auto const results = pgm8::probe_many(probe_paths, 3);
+      ntest::assert_uint64(probe_paths.size(), results.size());
+      for (size_t i = 0; i < results.size(); ++i)
+      {
+        bool const should_fail = (i == 2 || i == 6);
+        ntest::assert_bool(should_fail, static_cast<bool>(results[i].error));
+        if (should_fail)
+          continue;
+
+        std::ifstream file(probe_paths[i], std::ios::binary);
+        auto const hdr = pgm8::read_header(file);
+        ntest::assert_uint64(hdr.get_properties().get_width(), results[i].props.get_width());
+        ntest::assert_uint64(hdr.get_properties().get_height(), results[i].props.get_height());
+        ntest::assert_uint64(hdr.get_properties().get_maxval(), results[i].props.get_maxval());
+        ntest::assert_bool(hdr.get_properties().get_format() == results[i].props.get_format(), true);
+        ntest::assert_uint64(hdr.get_raster_offset(), results[i].raster_offset);
+      }
+      ntest::assert_uint64(7, pgm8::probe("files/medium-header.plain.pgm").props.get_maxval());
+
+      ntest::assert_throws<std::runtime_error>([]() {
+        auto const res = pgm8::probe("files/does-not-exist.pgm");
+      });
+    }
+
+#if PGM8_POSIX
+    // corpus index
+    {
+      std::filesystem::create_directories("files/corpus/nested");
+      std::filesystem::copy_file("files/with_comments/large.raw.pgm", "files/corpus/large.pgm");
+      std::filesystem::copy_file("files/no_comments/horiz.plain.pgm", "files/corpus/nested/horiz.pgm");
+      std::filesystem::copy_file("files/medium-header.plain.pgm", "files/corpus/nested/medium.pgm");
+      write_text_file("files/corpus/broken.pgm", "P7\n");
+      write_text_file("files/corpus/notes.txt", "not an image");
+
+      auto const expect_entry = [](
+        pgm8::corpus_index const &index,
+        std::string_view const path,
+        std::string const &file_path,
+        std::source_location const loc = std::source_location::current())
+      {
+        auto const found = index.find(path);
+        ntest::assert_bool(true, found.has_value(), loc);
+        if (!found)
+          return;
+
+        auto const expected = pgm8::probe(file_path);
+        ntest::assert_stdstr(std::string(path), std::string(found->path), ntest::default_str_opts(), loc);
+        ntest::assert_uint64(std::filesystem::file_size(file_path), found->file_size, loc);
+        ntest::assert_uint16(expected.props.get_width(), found->props.get_width(), loc);
+        ntest::assert_uint16(expected.props.get_height(), found->props.get_height(), loc);
+        ntest::assert_uint8(expected.props.get_maxval(), found->props.get_maxval(), loc);
+        ntest::assert_uint64(expected.raster_offset, found->raster_offset, loc);
+      };
+
+      {
+        pgm8::corpus_index index("files/corpus.idx");
+        ntest::assert_uint64(0, index.size());
+        ntest::assert_uint64(4, index.update("files/corpus", 2));
+        ntest::assert_uint64(3, index.size());
+        expect_entry(index, "large.pgm", "files/corpus/large.pgm");
+        expect_entry(index, "nested/horiz.pgm", "files/corpus/nested/horiz.pgm");
+        ntest::assert_bool(false, index.find("broken.pgm").has_value());
+        ntest::assert_bool(false, index.find("notes.txt").has_value());
+
+        // nothing changed, including the file which failed to probe
+        ntest::assert_uint64(0, index.update("files/corpus"));
+      }
+
+      std::filesystem::remove("files/corpus/nested/medium.pgm");
+      std::filesystem::copy_file("files/with_comments/vert-grad.raw.pgm", "files/corpus/nested/horiz.pgm",
+        std::filesystem::copy_options::overwrite_existing);
+      {
+        pgm8::corpus_index index("files/corpus.idx");
+        ntest::assert_uint64(3, index.size());
+        expect_entry(index, "nested/medium.pgm", "files/medium-header.plain.pgm");
+
+        ntest::assert_uint64(1, index.update("files/corpus"));
+        ntest::assert_uint64(2, index.size());
+        expect_entry(index, "nested/horiz.pgm", "files/corpus/nested/horiz.pgm");
+        ntest::assert_bool(false, index.find("nested/medium.pgm").has_value());
+        ntest::assert_stdstr(std::string("large.pgm"), std::string(index.get_entry(0).path));
+      }
+
+      write_text_file("files/corpus-bad.idx", "PGM8IDX");
+      ntest::assert_throws<std::runtime_error>([]() {
+        pgm8::corpus_index const index("files/corpus-bad.idx");
+      });
+
+      // every bucket taken, lookups would never stop
+      {
+        std::filesystem::copy_file("files/corpus.idx", "files/corpus-full.idx");
+        std::fstream file("files/corpus-full.idx", std::ios::in | std::ios::out | std::ios::binary);
+        uint32_t fields[4]; // num_records, num_images, num_buckets, strings_size
+        file.seekg(12);
+        file.read(reinterpret_cast<char *>(fields), sizeof(fields));
+        std::vector<uint32_t> const buckets(fields[2], 1);
+        auto const buckets_size = static_cast<std::streamoff>(buckets.size() * sizeof(uint32_t));
+        file.seekp(static_cast<std::streamoff>(std::filesystem::file_size("files/corpus-full.idx") - fields[3]) - buckets_size);
+        file.write(reinterpret_cast<char const *>(buckets.data()), buckets_size);
+      }
+      ntest::assert_stdstr("index has no empty bucket", ntest::assert_throws<std::runtime_error>([]() {
+        pgm8::corpus_index const index("files/corpus-full.idx");
+      }));
+    }
+#endif
+
+    // rescaling, against the reference formulas for every maxval
+    {
+      std::vector<uint8_t> expected_read{}, actual_read_raw{}, actual_read_plain{}, actual_read_parallel{};
+      std::vector<uint8_t> expected_write{}, actual_write{};
+
+      for (unsigned maxval = 1; maxval <= 255; ++maxval)
+      {
+        // every legal sample, then one above maxval which saturates
+        std::vector<uint8_t> samples{};
+        for (unsigned v = 0; v <= maxval; ++v) {
+          samples.push_back(static_cast<uint8_t>(v));
+          expected_read.push_back(static_cast<uint8_t>(((v * 255) + (maxval / 2)) / maxval));
+        }
+        samples.push_back(255);
+        expected_read.push_back(255);
+
+        pgm8::image_properties props;
+        props.set_width(static_cast<uint16_t>(samples.size()));
+        props.set_height(1);
+        props.set_maxval(static_cast<uint8_t>(maxval));
+
+        for (pgm8::format const fmt : { pgm8::format::RAW, pgm8::format::PLAIN })
+        {
+          props.set_format(fmt);
+          std::vector<uint8_t> encoded{};
+          pgm8::write(encoded, props, {}, samples.data());
+
+          auto const decoded = read_memory(encoded, { .rescale = true });
+          auto &actual_read = (fmt == pgm8::format::RAW) ? actual_read_raw : actual_read_plain;
+          actual_read.insert(actual_read.end(), decoded.begin(), decoded.end());
+
+          if (fmt == pgm8::format::PLAIN) {
+            auto const decoded_parallel = read_memory(encoded, { .num_threads = 3, .chunk_size = 16, .rescale = true });
+            actual_read_parallel.insert(actual_read_parallel.end(), decoded_parallel.begin(), decoded_parallel.end());
+          }
+        }
+
+        std::vector<uint8_t> full_range(256);
+        for (unsigned v = 0; v <= 255; ++v) {
+          full_range[v] = static_cast<uint8_t>(v);
+          expected_write.push_back(static_cast<uint8_t>(((v * maxval) + 127) / 255));
+        }
+        props.set_width(256);
+        props.set_format(pgm8::format::RAW);
+
+        std::vector<uint8_t> encoded{};
+        pgm8::write(encoded, props, {}, full_range.data(), { .rescale = true });
+        auto const decoded = read_memory(encoded, {});
+        actual_write.insert(actual_write.end(), decoded.begin(), decoded.end());
+      }
+
+      ntest::assert_stdvec(expected_read, actual_read_raw);
+      ntest::assert_stdvec(expected_read, actual_read_plain);
+      ntest::assert_stdvec(expected_read, actual_read_parallel);
+      ntest::assert_stdvec(expected_write, actual_write);
+
+      // a larger image through files, so pixels are rescaled block by block
+      pgm8::image_properties props;
+      props.set_width(300);
+      props.set_height(300);
+      props.set_maxval(100);
+
+      std::vector<uint8_t> full_range(props.num_pixels()), expected(props.num_pixels());
+      for (size_t i = 0; i < full_range.size(); ++i) {
+        full_range[i] = static_cast<uint8_t>((i * 7) % 256);
+        unsigned const written = ((full_range[i] * 100u) + 127) / 255;
+        expected[i] = static_cast<uint8_t>(((written * 255) + 50) / 100);
+      }
+
+      for (pgm8::format const fmt : { pgm8::format::RAW, pgm8::format::PLAIN })
+      {
+        props.set_format(fmt);
+        for (unsigned const num_threads : { 1u, 3u })
+        {
+          {
+            std::ofstream file("files/rescaled.pgm", std::ios::binary);
+            pgm8::write(file, props, {}, full_range.data(), { .num_threads = num_threads, .rows_per_block = 7, .rescale = true });
+          }
+          std::ifstream file("files/rescaled.pgm", std::ios::binary);
+          auto const props_found = pgm8::read_properties(file);
+          pgm8::skip_comments(file);
+          std::vector<uint8_t> pixels(props_found.num_pixels());
+          pgm8::read_pixels(file, props_found, pixels.data(), { .num_threads = num_threads, .chunk_size = 1000, .rescale = true });
+          ntest::assert_uint8(100, props_found.get_maxval());
+          ntest::assert_stdvec(expected, pixels);
+        }
+      }
+    }
+
+    // validation against maxval, and maxval computed on write
+    {
+      pgm8::image_properties props;
+      props.set_width(70);
+      props.set_height(3);
+      props.set_maxval(200);
+
+      std::vector<uint8_t> pixels(props.num_pixels());
+      for (size_t i = 0; i < pixels.size(); ++i)
+        pixels[i] = static_cast<uint8_t>(i % 200);
+
+      for (pgm8::format const fmt : { pgm8::format::RAW, pgm8::format::PLAIN, pgm8::format::COMPRESSED })
+      {
+        props.set_format(fmt);
+        std::vector<uint8_t> encoded{};
+        pgm8::write(encoded, props, {}, pixels.data(), { .validate = true });
+        ntest::assert_stdvec(pixels, read_memory(encoded, { .validate = true }));
+
+        // sample 150 is above maxval
+        std::vector<uint8_t> bad_pixels = pixels;
+        bad_pixels[150] = 201;
+        std::vector<uint8_t> bad_encoded{};
+        for (unsigned const num_threads : { 1u, 3u }) {
+          std::string const write_err = ntest::assert_throws<std::runtime_error>([&]() {
+            pgm8::write(bad_encoded, props, {}, bad_pixels.data(), { .num_threads = num_threads, .rows_per_block = 1, .validate = true });
+          });
+          ntest::assert_stdstr("pixel 150 out of range (> 200)", write_err);
+          ntest::assert_uint64(0, bad_encoded.size());
+        }
+
+        pgm8::write(bad_encoded, props, {}, bad_pixels.data());
+        for (unsigned const num_threads : { 1u, 3u }) {
+          std::string const read_err = ntest::assert_throws<std::runtime_error>([&]() {
+            auto const decoded = read_memory(bad_encoded, { .num_threads = num_threads, .chunk_size = 64, .validate = true });
+          });
+          ntest::assert_stdstr("pixel 150 out of range (> 200)", read_err);
+        }
+      }
+
+      pgm8::image_properties unset_maxval;
+      unset_maxval.set_width(props.get_width());
+      unset_maxval.set_height(props.get_height());
+      unset_maxval.set_format(pgm8::format::RAW);
+
+      std::vector<uint8_t> encoded{};
+      pgm8::write(encoded, unset_maxval, {}, pixels.data(), { .compute_maxval = true });
+      size_t num_consumed = 0;
+      ntest::assert_uint8(199, pgm8::read_properties(encoded, num_consumed).get_maxval());
+
+      std::vector<uint8_t> const zeros(props.num_pixels(), 0);
+      encoded.clear();
+      pgm8::write(encoded, unset_maxval, {}, zeros.data(), { .compute_maxval = true });
+      ntest::assert_uint8(1, pgm8::read_properties(encoded, num_consumed).get_maxval());
+    }
+
+    // writes to a path, compared byte for byte with the stream writer
+    {
+      std::ifstream source("files/with_comments/large.raw.pgm", std::ios::binary);
+      auto props = pgm8::read_properties(source);
+      auto const comments = pgm8::read_comments(source);
+      std::vector<uint8_t> pixels(props.num_pixels());
+      pgm8::read_pixels(source, props, pixels.data());
+
+      auto const read_file = [](std::string const &path)
+      {
+        std::ifstream file(path, std::ios::binary);
+        return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+      };
+
+      for (pgm8::format const fmt : { pgm8::format::RAW, pgm8::format::PLAIN })
+      {
+        props.set_format(fmt);
+        std::vector<uint8_t> expected{};
+        pgm8::write(expected, props, comments, pixels.data());
+
+        for (bool const preallocate : { false, true })
+          for (bool const direct_io : { false, true })
+          {
+            pgm8::write("files/written.pgm", props, comments, pixels.data(), {
+              .num_threads = 2,
+              .preallocate = preallocate,
+              .direct_io = direct_io,
+            });
+            ntest::assert_stdvec(expected, read_file("files/written.pgm"));
+          }
+      }
+
+      ntest::assert_throws<std::runtime_error>([&]() {
+        pgm8::write("files/no-such-dir/written.pgm", props, comments, pixels.data());
+      });
+
+      // the last sample is above maxval, nothing written before it is kept
+      {
+        auto bad_props = props;
+        bad_props.set_maxval(200);
+        std::vector<uint8_t> bad_pixels(pixels.size());
+        for (size_t i = 0; i < pixels.size(); ++i)
+          bad_pixels[i] = std::min<uint8_t>(pixels[i], 200);
+        bad_pixels.back() = 201;
+
+        for (pgm8::format const fmt : { pgm8::format::RAW, pgm8::format::PLAIN })
+          for (bool const direct_io : { false, true })
+          {
+            bad_props.set_format(fmt);
+            ntest::assert_throws<std::runtime_error>([&]() {
+              pgm8::write("files/written.pgm", bad_props, comments, bad_pixels.data(), {
+                .validate = true,
+                .preallocate = true,
+                .direct_io = direct_io,
+              });
+            });
+            ntest::assert_uint64(0, std::filesystem::file_size("files/written.pgm"));
+          }
+      }
+    }
+
+    // COMPRESSED round trips
+    {
+      std::ifstream source("files/with_comments/large.raw.pgm", std::ios::binary);
+      auto props = pgm8::read_properties(source);
+      auto const comments = pgm8::read_comments(source);
+      std::vector<uint8_t> pixels(props.num_pixels());
+      pgm8::read_pixels(source, props, pixels.data());
+      props.set_format(pgm8::format::COMPRESSED);
+
+      std::vector<uint8_t> encoded{};
+      size_t const encoded_size = pgm8::write(encoded, props, comments, pixels.data());
+      ntest::assert_bool(true, encoded_size <= pgm8::max_encoded_size(props, comments));
+      ntest::assert_stdvec(pixels, read_memory(encoded, {}));
+      ntest::assert_stdvec(pixels, read_memory(encoded, { .validate = true }));
+
+      write_rows_test("files/large.compressed.pgm", { props, comments, pixels.data() }, 7);
+      read_rows_test("files/large.compressed.pgm", { props, comments, pixels.data() }, 3);
+      write_and_read_back_memory_test({ props, comments, pixels.data() });
+
+      // smooth images shrink well
+      std::vector<uint8_t> smooth(props.num_pixels());
+      for (size_t i = 0; i < smooth.size(); ++i)
+        smooth[i] = static_cast<uint8_t>(((i % props.get_width()) / 64) + ((i / props.get_width()) / 4));
+      std::vector<uint8_t> smooth_encoded{};
+      pgm8::write(smooth_encoded, props, {}, smooth.data());
+      ntest::assert_bool(true, smooth_encoded.size() < props.num_pixels() / 8);
+      ntest::assert_stdvec(smooth, read_memory(smooth_encoded, {}));
+
+      // rows wider than an output block, with nothing to compress
+      pgm8::image_properties wide;
+      wide.set_width(UINT16_MAX);
+      wide.set_height(3);
+      wide.set_maxval(UINT8_MAX);
+      wide.set_format(pgm8::format::COMPRESSED);
+      std::vector<uint8_t> noise(wide.num_pixels());
+      uint32_t state = 12345;
+      for (auto &px : noise)
+        px = static_cast<uint8_t>((state = (state * 1103515245) + 12345) >> 16);
+      write_rows_test("files/wide.compressed.pgm", { wide, {}, noise.data() }, 2);
+
+      // rescaled on the way in and out
+      props.set_maxval(100);
+      std::vector<uint8_t> raw_encoded{};
+      props.set_format(pgm8::format::RAW);
+      pgm8::write(raw_encoded, props, {}, pixels.data(), { .rescale = true });
+      props.set_format(pgm8::format::COMPRESSED);
+      encoded.clear();
+      pgm8::write(encoded, props, {}, pixels.data(), { .rescale = true });
+      ntest::assert_stdvec(read_memory(raw_encoded, { .rescale = true }), read_memory(encoded, { .rescale = true }));
+
+      // a run past the end of a 2 pixel row
+      std::string const corrupt = "P8 2 2 255\n\x80\x07\x82\x07";
+      std::vector<uint8_t> const corrupt_bytes(corrupt.begin(), corrupt.end());
+      std::string const err = ntest::assert_throws<std::runtime_error>([&]() {
+        auto const decoded = read_memory(corrupt_bytes, {});
+      });
+      ntest::assert_stdstr("compressed row 1 corrupt, run past end of row", err);
+
+      // input ending right after a run, short of the end of the row
+      std::vector<uint8_t> const truncated_bytes{ 'P', '8', ' ', '4', ' ', '1', ' ', '2', '5', '5', '\n', 0x01, 5, 6 };
+      ntest::assert_stdstr("unexpected end of pixel data, read 0 of 1 rows", ntest::assert_throws<std::runtime_error>([&]() {
+        auto const decoded = read_memory(truncated_bytes, {});
+      }));
+    }
+
+    // gzip
+    {
+      std::ifstream source("files/with_comments/large.raw.pgm", std::ios::binary);
+      auto props = pgm8::read_properties(source);
+      auto const comments = pgm8::read_comments(source);
+      std::vector<uint8_t> pixels(props.num_pixels());
+      pgm8::read_pixels(source, props, pixels.data());
+
+#if PGM8_ZLIB
+      std::vector<std::string> paths{};
+      for (pgm8::format const fmt : { pgm8::format::RAW, pgm8::format::PLAIN, pgm8::format::COMPRESSED })
+      {
+        props.set_format(fmt);
+        paths.push_back("files/large-" + std::to_string(static_cast<int>(fmt)) + ".pgm.gz");
+        pgm8::write(paths.back(), props, comments, pixels.data(), { .gzip_level = 6 });
+
+        std::ifstream file(paths.back(), std::ios::binary);
+        ntest::assert_uint64(0x1f, static_cast<uint64_t>(file.get()));
+        ntest::assert_uint64(0x8b, static_cast<uint64_t>(file.get()));
+
+        // all of the output reaches the file, however zlib splits it up
+        file.seekg(0);
+        std::vector<uint8_t> const written(std::istreambuf_iterator<char>(file), {});
+        std::vector<uint8_t> in_memory{};
+        pgm8::write(in_memory, props, comments, pixels.data(), { .gzip_level = 6 });
+        ntest::assert_stdvec(in_memory, written);
+
+        auto const img = pgm8::read(paths.back());
+        std::vector<uint8_t> read_back{};
+        for (size_t r = 0; r < props.get_height(); ++r)
+          read_back.insert(read_back.end(), img.row(r), img.row(r) + props.get_width());
+        ntest::assert_stdvec(pixels, read_back);
+        ntest::assert_stdvec(comments, img.get_comments());
+      }
+
+      for (auto const &item : pgm8::read_batch(paths))
+        ntest::assert_arr(pixels.data(), pixels.size(), item.pixels.get(), item.props.num_pixels());
+      pgm8::read_batch_async(paths, [&](pgm8::batch_item &&item) {
+        ntest::assert_arr(pixels.data(), pixels.size(), item.pixels.get(), item.props.num_pixels());
+      });
+
+      std::filesystem::resize_file(paths.back(), std::filesystem::file_size(paths.back()) / 2);
+      ntest::assert_throws<std::runtime_error>([&]() {
+        auto const img = pgm8::read(paths.back());
+      });
+#else
+      ntest::assert_throws<std::runtime_error>([&]() {
+        std::vector<uint8_t> encoded{};
+        pgm8::write(encoded, props, comments, pixels.data(), { .gzip_level = 6 });
+      });
+      {
+        std::ofstream file("files/fake.pgm.gz", std::ios::binary);
+        file << "\x1f\x8b";
+      }
+      std::string const err = ntest::assert_throws<std::runtime_error>([]() {
+        auto const img = pgm8::read("files/fake.pgm.gz");
+      });
+      ntest::assert_stdstr("gzip data, but pgm8 was built without PGM8_ZLIB", err);
+#endif
+    }
+
+    // downscaled while decoding, against a straightforward box filter
+    {
+      pgm8::image_properties props;
+      props.set_width(103);
+      props.set_height(61);
+      props.set_maxval(255);
+      props.set_format(pgm8::format::RAW);
+
+      std::vector<uint8_t> const pixels = downscale_test_pixels(props);
+
+      std::vector<uint16_t> const factors { 1, 2, 3, 4, 7, 8, 64, 256 };
+      std::vector<uint8_t> expected{};
+      for (uint16_t const factor : factors) {
+        auto const filtered = box_filter(pixels, props, factor);
+        expected.insert(expected.end(), filtered.begin(), filtered.end());
+      }
+
+      for (pgm8::format const fmt : { pgm8::format::RAW, pgm8::format::PLAIN, pgm8::format::COMPRESSED })
+      {
+        props.set_format(fmt);
+        {
+          std::ofstream file("files/downscale.pgm", std::ios::binary);
+          pgm8::write(file, props, {}, pixels.data());
+          file << "P";
+        }
+
+        std::vector<uint8_t> actual{};
+        for (uint16_t const factor : factors)
+        {
+          std::ifstream file("files/downscale.pgm", std::ios::binary);
+          auto const props_found = pgm8::read_properties(file);
+          pgm8::skip_comments(file);
+          std::vector<uint8_t> out(pgm8::downscaled_properties(props_found, factor).num_pixels());
+          pgm8::read_downscaled(file, props_found, factor, out.data());
+          actual.insert(actual.end(), out.begin(), out.end());
+          // left at the end of the raster
+          file >> std::ws;
+          ntest::assert_uint64('P', static_cast<uint64_t>(file.get()));
+        }
+        ntest::assert_stdvec(expected, actual);
+      }
+
+      ntest::assert_throws<std::runtime_error>([&]() {
+        static_cast<void>(pgm8::downscaled_properties(props, 257));
+      });
+    }
+
+    // pyramids, against levels halved one at a time
+    {
+      pgm8::image_properties props;
+      props.set_width(1001);
+      props.set_height(701);
+      props.set_maxval(255);
+      props.set_format(pgm8::format::RAW);
+
+      std::vector<uint8_t> const pixels = downscale_test_pixels(props);
+
+      unsigned const levels = 4;
+      std::vector<std::vector<uint8_t>> expected{ pixels };
+      std::vector<pgm8::image_properties> expected_props{ props };
+      for (unsigned l = 1; l < levels; ++l) {
+        expected.push_back(box_filter(expected.back(), expected_props.back(), 2));
+        expected_props.push_back(pgm8::downscaled_properties(expected_props.back(), 2));
+      }
+
+      for (unsigned const num_threads : { 1u, 3u })
+      {
+        pgm8::write_pyramid("files/pyramid", props, pixels.data(), levels, { .num_threads = num_threads });
+        for (unsigned l = 0; l < levels; ++l)
+        {
+          auto const img = pgm8::read("files/pyramid." + std::to_string(l) + ".pgm");
+          std::vector<uint8_t> actual{};
+          for (size_t r = 0; r < img.get_properties().get_height(); ++r)
+            actual.insert(actual.end(), img.row(r), img.row(r) + img.get_properties().get_width());
+          assert_image({ expected_props[l], {}, expected[l].data() }, { img.get_properties(), {}, actual.data() });
+        }
+      }
+
+      pgm8::write_pyramid("files/pyramid", props, pixels.data(), levels, { .archive = true });
+#if PGM8_POSIX
+      pgm8::archive_reader const reader("files/pyramid.pgma");
+      ntest::assert_uint64(levels, reader.size());
+      for (unsigned l = 0; l < levels; ++l) {
+        auto const entry = reader.find(std::to_string(l));
+        assert_image({ expected_props[l], {}, expected[l].data() }, { entry->props, {}, entry->pixels.data() });
+      }
+#endif
+
+      ntest::assert_throws<std::runtime_error>([&]() {
+        pgm8::write_pyramid("files/pyramid", props, pixels.data(), 0);
+      });
+    }
+
+    // frame streams
+    {
+      pgm8::image_properties small;
+      small.set_width(40);
+      small.set_height(30);
+      small.set_maxval(255);
+      small.set_format(pgm8::format::RAW);
+      pgm8::image_properties big = small;
+      big.set_width(90);
+      big.set_format(pgm8::format::PLAIN);
+      pgm8::image_properties compressed = small;
+      compressed.set_format(pgm8::format::COMPRESSED);
+
+      struct frame
+      {
+        pgm8::image_properties props;
+        std::vector<std::string> comments;
+      };
+      std::vector<frame> const frames {
+        { small, {} }, { small, {} }, { big, { "big" } }, { compressed, {} }, { small, {} }, { small, {} },
+      };
+
+      // each frame starts one pixel further in
+      std::vector<uint8_t> pixels(big.num_pixels() + frames.size());
+      for (size_t i = 0; i < pixels.size(); ++i)
+        pixels[i] = static_cast<uint8_t>(i * 13);
+
+      std::vector<uint8_t> expected{};
+      {
+        std::ofstream file("files/frames.pgm", std::ios::binary);
+        pgm8::frame_writer writer(file);
+        for (size_t i = 0; i < frames.size(); ++i) {
+          writer.write(frames[i].props, frames[i].comments, pixels.data() + i);
+          pgm8::write(expected, frames[i].props, frames[i].comments, pixels.data() + i);
+        }
+        ntest::assert_uint64(frames.size(), writer.num_frames_written());
+      }
+      {
+        std::ifstream file("files/frames.pgm", std::ios::binary);
+        ntest::assert_stdvec(expected, std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()));
+      }
+
+      auto const read_frames = [&](std::string const &path, pgm8::read_options const &options)
+      {
+        std::ifstream file(path, std::ios::binary);
+        pgm8::frame_reader reader(file, options);
+        std::vector<uint8_t const *> buffers{};
+        while (reader.next())
+        {
+          size_t const i = reader.num_frames_read() - 1;
+          buffers.push_back(reader.get_pixels().data());
+          assert_image(
+            { frames[i].props, frames[i].comments, pixels.data() + i },
+            { reader.get_properties(), reader.get_comments(), reader.get_pixels().data() });
+          ntest::assert_stdvec(frames[i].comments, reader.get_comments());
+        }
+        ntest::assert_uint64(frames.size(), reader.num_frames_read());
+        // reallocated only for the first frame, and the first larger one
+        ntest::assert_uint64(2, std::set<uint8_t const *>(buffers.begin(), buffers.end()).size());
+      };
+      read_frames("files/frames.pgm", {});
+#if PGM8_POSIX
+      // through a pipe, as from a sensor, so each frame must be read no further than its end
+      for (unsigned const num_threads : { 1u, 3u }) {
+        fifo_feed const feed("files/frames.fifo", std::string(expected.begin(), expected.end()));
+        read_frames("files/frames.fifo", { .num_threads = num_threads, .chunk_size = 64 });
+      }
+#endif
+
+      std::filesystem::resize_file("files/frames.pgm", expected.size() - 1);
+      ntest::assert_throws<std::runtime_error>([]() {
+        std::ifstream truncated("files/frames.pgm", std::ios::binary);
+        pgm8::frame_reader truncated_reader(truncated);
+        while (truncated_reader.next()) {}
+      });
+    }
+
+    // archives
+    {
+      std::vector<std::string> const names { "large", "vert-grad", "nested/horiz" };
+      std::vector<pgm8::image> images{};
+      for (char const *const path : {
+        "files/with_comments/large.raw.pgm",
+        "files/with_comments/vert-grad.raw.pgm",
+        "files/no_comments/horiz.plain.pgm" })
+      {
+        images.push_back(pgm8::read(path));
+      }
+
+      auto const contiguous_pixels = [](pgm8::image const &img)
+      {
+        auto const props = img.get_properties();
+        std::vector<uint8_t> pixels{};
+        for (size_t r = 0; r < props.get_height(); ++r)
+          pixels.insert(pixels.end(), img.row(r), img.row(r) + props.get_width());
+        return pixels;
+      };
+
+      {
+        pgm8::archive_writer writer("files/images.pgma");
+        for (size_t i = 0; i < images.size(); ++i)
+          writer.add(names[i], images[i].get_properties(), contiguous_pixels(images[i]).data());
+
+        ntest::assert_throws<std::runtime_error>([&]() {
+          writer.add("large", images[0].get_properties(), contiguous_pixels(images[0]).data());
+        });
+        ntest::assert_uint64(3, writer.size());
+        writer.close();
+      }
+      {
+        // the destructor writes the index if close() isn't called
+        pgm8::archive_writer writer("files/unclosed.pgma");
+        writer.add("only", images[1].get_properties(), contiguous_pixels(images[1]).data());
+      }
+
+#if PGM8_POSIX
+      pgm8::archive_reader const reader("files/images.pgma", pgm8::access_hint::RANDOM);
+      ntest::assert_uint64(3, reader.size());
+      for (size_t i = 0; i < names.size(); ++i)
+      {
+        auto const by_index = reader.get_entry(i);
+        auto const by_name = reader.find(names[i]);
+        ntest::assert_bool(true, by_name.has_value());
+        ntest::assert_stdstr(names[i], std::string(by_index.name));
+        ntest::assert_uint64(reinterpret_cast<uintptr_t>(by_index.pixels.data()), reinterpret_cast<uintptr_t>(by_name->pixels.data()));
+        ntest::assert_uint64(0, reinterpret_cast<uintptr_t>(by_index.pixels.data()) % pgm8::archive_writer::alignment);
+
+        auto const expected = contiguous_pixels(images[i]);
+        assert_image(
+          { images[i].get_properties(), images[i].get_comments(), expected.data() },
+          { by_index.props, images[i].get_comments(), by_index.pixels.data() });
+      }
+      ntest::assert_bool(false, reader.find("missing").has_value());
+
+      pgm8::archive_reader const unclosed("files/unclosed.pgma");
+      ntest::assert_uint64(1, unclosed.size());
+      ntest::assert_bool(true, unclosed.find("only").has_value());
+
+      // every bucket taken, lookups would never stop
+      {
+        std::filesystem::copy_file("files/images.pgma", "files/images-full.pgma");
+        auto const size = std::filesystem::file_size("files/images-full.pgma");
+        std::fstream file("files/images-full.pgma", std::ios::in | std::ios::out | std::ios::binary);
+        uint64_t index_offset;
+        uint32_t counts[2]; // num_images, num_buckets
+        file.seekg(static_cast<std::streamoff>(size - 32));
+        file.read(reinterpret_cast<char *>(&index_offset), sizeof(index_offset));
+        file.read(reinterpret_cast<char *>(counts), sizeof(counts));
+        std::vector<uint32_t> const buckets(counts[1], 1);
+        file.seekp(static_cast<std::streamoff>(index_offset + (counts[0] * 24)));
+        file.write(reinterpret_cast<char const *>(buckets.data()), static_cast<std::streamsize>(buckets.size() * sizeof(uint32_t)));
+      }
+      ntest::assert_stdstr("archive has no empty bucket", ntest::assert_throws<std::runtime_error>([]() {
+        pgm8::archive_reader const full("files/images-full.pgma");
+      }));
+
+      // raster offset that wraps around when the size of "large" is added
+      {
+        std::filesystem::copy_file("files/images.pgma", "files/images-wrapped.pgma");
+        auto const size = std::filesystem::file_size("files/images-wrapped.pgma");
+        std::fstream file("files/images-wrapped.pgma", std::ios::in | std::ios::out | std::ios::binary);
+        uint64_t index_offset;
+        file.seekg(static_cast<std::streamoff>(size - 32));
+        file.read(reinterpret_cast<char *>(&index_offset), sizeof(index_offset));
+        uint64_t const raster_offset = 0xFFFFFFFFFFFFF000;
+        file.seekp(static_cast<std::streamoff>(index_offset));
+        file.write(reinterpret_cast<char const *>(&raster_offset), sizeof(raster_offset));
+      }
+      ntest::assert_stdstr("archive raster out of range", ntest::assert_throws<std::runtime_error>([]() {
+        pgm8::archive_reader const wrapped("files/images-wrapped.pgma");
+      }));
+
+      std::filesystem::resize_file("files/unclosed.pgma", pgm8::archive_writer::alignment + 10);
+      ntest::assert_throws<std::runtime_error>([]() {
+        pgm8::archive_reader const truncated("files/unclosed.pgma");
+      });
+#endif
+    }
+
     {
       auto const res = ntest::generate_report("cpp-pgm8");
       std::cout << res.num_fails << " failed, " << res.num_passes << " passed\n";